@@ -0,0 +1,309 @@
+// Shared region for large binary results (page captures, PDFs, snapshots),
+// so they skip base64 and the JSON pipe.
+//
+// On $/blob/open we create a file of our own in the temp directory, map it
+// and tell the peer its path; each result is copied into a free range of
+// it. The reply only names the range:
+//     {"blob": {"handle": h, "offset": o, "length": n}}
+// and the peer reads those bytes from the file (the page cache, really)
+// and hands the range back with $/blob/release {"handles": [h, ...]}.
+// When no region is open, or it has no room, the result goes inline as
+// {"base64": "..."} instead, see Context::reply_bytes().
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace jsonrpc {
+namespace blob {
+
+#ifdef _WIN32
+namespace details {
+
+inline std::wstring widen(const std::string& s) {
+    int n = MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), nullptr, 0);
+    std::wstring w(n > 0 ? n : 0, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), w.data(), n);
+    return w;
+}
+
+inline std::string narrow(const std::wstring& w) {
+    int n = WideCharToMultiByte(CP_UTF8, 0, w.data(), (int)w.size(), nullptr, 0, nullptr, nullptr);
+    std::string s(n > 0 ? n : 0, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, w.data(), (int)w.size(), s.data(), n, nullptr, nullptr);
+    return s;
+}
+
+} // namespace details
+#endif
+
+// A result stored in the region.
+struct Ref {
+    uint32_t handle = 0;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+};
+
+class Region {
+public:
+    // Ranges start on this boundary.
+    static constexpr uint64_t kAlign = 64;
+    // Largest region open() makes.
+    static constexpr uint64_t kMaxCapacity = uint64_t(1) << 30;
+
+    struct Stats {
+        uint64_t capacity = 0;
+        uint64_t used = 0;      // Bytes held by live blobs, alignment included.
+        size_t live = 0;        // Blobs not yet released.
+        uint64_t fallbacks = 0; // Results that did not fit.
+    };
+
+    Region() = default;
+    Region(const Region&) = delete;
+    Region& operator=(const Region&) = delete;
+    ~Region() { close(); }
+
+    // Create a new file of the given size (at most kMaxCapacity) in the
+    // user's temp directory and map it, replacing an open region. Blobs of
+    // the old one are gone. Returns false if the file cannot be created or
+    // mapped. The file is ours: only its owner may open it, and close()
+    // deletes it.
+    bool open(uint64_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        close_locked();
+        capacity -= capacity % kAlign;
+        if (capacity == 0 || capacity > kMaxCapacity) return false;
+#ifdef _WIN32
+        // %TEMP% is in the user's profile. GetTempFileNameW creates an empty
+        // file under a fresh name, which we then take over.
+        wchar_t dir[MAX_PATH + 1];
+        wchar_t name[MAX_PATH + 1];
+        DWORD n = GetTempPathW(MAX_PATH + 1, dir);
+        if (n == 0 || n > MAX_PATH || GetTempFileNameW(dir, L"wv2", 0, name) == 0) return false;
+        // The peer reads the file while we hold it, and may delete it.
+        file_ = CreateFileW(name, GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, TRUNCATE_EXISTING,
+            FILE_ATTRIBUTE_TEMPORARY, nullptr);
+        path_ = details::narrow(name);
+        if (file_ == INVALID_HANDLE_VALUE) {
+            DeleteFileW(name);
+            path_.clear();
+            return false;
+        }
+        mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READWRITE,
+            (DWORD)(capacity >> 32), (DWORD)capacity, nullptr);
+        void* base = mapping_ ? MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)capacity) : nullptr;
+#else
+        // mkstemp creates the file exclusively, mode 0600.
+        const char* tmp = std::getenv("TMPDIR");
+        std::string name = std::string(tmp && *tmp ? tmp : "/tmp") + "/wv2-blob-XXXXXX";
+        fd_ = ::mkstemp(name.data());
+        if (fd_ < 0) return false;
+        ::fcntl(fd_, F_SETFD, FD_CLOEXEC);
+        path_ = name;
+        void* base = nullptr;
+        if (::ftruncate(fd_, (off_t)capacity) == 0) {
+            base = ::mmap(nullptr, (size_t)capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            if (base == MAP_FAILED) base = nullptr;
+        }
+#endif
+        if (!base) {
+            close_locked();
+            return false;
+        }
+        base_ = static_cast<char*>(base);
+        capacity_ = capacity;
+        free_[0] = capacity;
+        return true;
+    }
+
+    // Unmap and delete the file.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        close_locked();
+    }
+
+    bool is_open() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return base_ != nullptr;
+    }
+
+    std::string path() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return path_;
+    }
+
+    // Copy data into a free range. nullopt if no region is open or no
+    // range is large enough. Any thread.
+    std::optional<Ref> put(std::string_view data) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!base_) return std::nullopt;
+        uint64_t size = (std::max)((uint64_t)data.size(), uint64_t(1));
+        size += (kAlign - size % kAlign) % kAlign;
+        // First fit: the region mostly holds a few large blobs at a time.
+        auto it = free_.begin();
+        while (it != free_.end() && it->second < size) ++it;
+        if (it == free_.end()) {
+            fallbacks_++;
+            return std::nullopt;
+        }
+        uint64_t offset = it->first;
+        uint64_t left = it->second - size;
+        free_.erase(it);
+        if (left > 0) free_[offset + size] = left;
+        std::memcpy(base_ + offset, data.data(), data.size());
+        Ref ref{ next_handle_++, offset, data.size() };
+        if (next_handle_ == 0) next_handle_ = 1;
+        live_[ref.handle] = { offset, size };
+        used_ += size;
+        return ref;
+    }
+
+    // Give a range back. Returns false for an unknown handle. Any thread.
+    bool release(uint32_t handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = live_.find(handle);
+        if (it == live_.end()) return false;
+        auto [offset, size] = it->second;
+        live_.erase(it);
+        used_ -= size;
+        // Merge with the free neighbours.
+        auto next = free_.lower_bound(offset);
+        if (next != free_.end() && offset + size == next->first) {
+            size += next->second;
+            next = free_.erase(next);
+        }
+        if (next != free_.begin()) {
+            auto prev = std::prev(next);
+            if (prev->first + prev->second == offset) {
+                prev->second += size;
+                return true;
+            }
+        }
+        free_[offset] = size;
+        return true;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return Stats{ capacity_, used_, live_.size(), fallbacks_ };
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::string path_;
+    char* base_ = nullptr;
+    uint64_t capacity_ = 0;
+    uint64_t used_ = 0;
+    uint64_t fallbacks_ = 0;
+    uint32_t next_handle_ = 1;
+    std::map<uint64_t, uint64_t> free_;                                  // offset -> size
+    std::unordered_map<uint32_t, std::pair<uint64_t, uint64_t>> live_;   // handle -> range
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+
+    void close_locked() {
+#ifdef _WIN32
+        if (base_) UnmapViewOfFile(base_);
+        if (mapping_) CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE) {
+            CloseHandle(file_);
+            DeleteFileW(details::widen(path_).c_str());
+        }
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (base_) ::munmap(base_, (size_t)capacity_);
+        if (fd_ >= 0) {
+            ::close(fd_);
+            ::unlink(path_.c_str());
+        }
+        fd_ = -1;
+#endif
+        base_ = nullptr;
+        capacity_ = 0;
+        used_ = 0;
+        path_.clear();
+        free_.clear();
+        live_.clear();
+    }
+};
+
+inline std::string base64_encode(std::string_view data) {
+    static constexpr char kTable[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.resize((data.size() + 2) / 3 * 4);
+    char* p = out.data();
+    size_t i = 0;
+    for (; i + 3 <= data.size(); i += 3) {
+        uint32_t v = (uint8_t)data[i] << 16 | (uint8_t)data[i + 1] << 8 | (uint8_t)data[i + 2];
+        *p++ = kTable[v >> 18];
+        *p++ = kTable[(v >> 12) & 63];
+        *p++ = kTable[(v >> 6) & 63];
+        *p++ = kTable[v & 63];
+    }
+    if (i < data.size()) {
+        uint32_t v = (uint8_t)data[i] << 16;
+        if (i + 1 < data.size()) v |= (uint8_t)data[i + 1] << 8;
+        *p++ = kTable[v >> 18];
+        *p++ = kTable[(v >> 12) & 63];
+        *p++ = i + 1 < data.size() ? kTable[(v >> 6) & 63] : '=';
+        *p++ = '=';
+    }
+    return out;
+}
+
+// nullopt on a character outside the alphabet or a bad length.
+inline std::optional<std::string> base64_decode(std::string_view text) {
+    static constexpr auto kValues = [] {
+        std::array<int8_t, 256> t{};
+        t.fill(-1);
+        const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (int i = 0; i < 64; i++) t[(uint8_t)chars[i]] = (int8_t)i;
+        return t;
+    }();
+    if (text.size() % 4 != 0) return std::nullopt;
+    size_t pad = 0;
+    while (pad < 2 && pad < text.size() && text[text.size() - 1 - pad] == '=') pad++;
+    std::string out;
+    out.reserve(text.size() / 4 * 3);
+    uint32_t v = 0;
+    int bits = 0;
+    for (size_t i = 0; i < text.size() - pad; i++) {
+        int8_t d = kValues[(uint8_t)text[i]];
+        if (d < 0) return std::nullopt;
+        v = v << 6 | (uint32_t)d;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(v >> bits));
+        }
+    }
+    return out;
+}
+
+} // namespace blob
+} // namespace jsonrpc
@@ -62,6 +62,13 @@
   :type '(repeat string)
   :group 'emacs-webview2)
 
+(defcustom t-blob-size (* 64 1024 1024)
+  "Size of the file large binary results are passed through, in bytes.
+Results such as page captures are read from this file instead of
+being sent as base64 through the pipe.  0 disables it."
+  :type 'integer
+  :group 'emacs-webview2)
+
 (defconst t--dir
   (if (not load-in-progress) default-directory
     (file-name-directory load-file-name))
@@ -84,7 +91,13 @@
    :documentation "Mapping of IDs to bound Emacs buffers.")
   (envs
    (make-hash-table :test #'equal) :type hash-table
-   :documentation "Initialized WebView2 environments."))
+   :documentation "Initialized WebView2 environments.")
+  (streams
+   (make-hash-table :test #'eql) :type hash-table
+   :documentation "Chunks of streamed results, by request id, newest first.")
+  (blob-file
+   nil :type string
+   :documentation "File shared with the manager for binary results."))
 
 (cl-defstruct (t--webview (:constructor t--webview-make)
                           (:copier nil))
@@ -172,14 +185,17 @@
       (let ((frame (window-frame (selected-window))))
         (select-frame-set-input-focus frame)))))
 
+(defun o-env-params (env-name)
+  "Return the env/create params of ENV-NAME from `t-env-alist'."
+  (if-let* ((config (cdr (assoc env-name t-env-alist))))
+      (append (list :name env-name) config)
+    (error "Undefined WebView2 Environment [%s]" env-name)))
+
 (defun o-ensure-env (env-name)
   (let ((table (o-envs t--mgr)))
     (unless (gethash env-name table)
-      (if-let* ((config (cdr (assoc env-name t-env-alist))))
-          (progn
-            (m-env/create (append (list :name env-name) config))
-            (puthash env-name t table))
-        (error "Undefined WebView2 Environment [%s]")))))
+      (m-env/create (o-env-params env-name))
+      (puthash env-name t table))))
 
 (defun o-register-env (name &rest plist)
   (let ((table (o-envs t--mgr)))
@@ -325,7 +341,7 @@
 (cl-defun o-spawn (&key buffer url env rect rect-fn
                         (activate t) (keys t-default-intercept-keys))
   (let* ((env (or env t-default-env))
-         (_ (o-ensure-env env))
+         (new-env (not (gethash env (o-envs t--mgr))))
          (win (and buffer (get-buffer-window buffer 'visible)))
          (rect (or rect
                    (and rect-fn win (funcall rect-fn win))
@@ -339,15 +355,31 @@
                                 (puthash val key-str tbl)))
                             keys)
                       tbl))
-         (id (m-wv/create hwnd visible rect url env))
+         ;; One round trip: the environment when it is new, the webview,
+         ;; and its intercepted keys, given the new id as (:$ref N).
+         (n (if new-env 1 0))
+         (results (m-app/multi
+                   `(,@(when new-env `((env/create . ,(o-env-params env))))
+                     (wv/create . ,(t--wv-create-params hwnd visible rect url env))
+                     (wv/set-intercept-keys
+                      . [(:$ref ,n) ,(vconcat (hash-table-keys key-table))]))
+                   ;; A later call failed: keep the environment, which
+                   ;; exists now, and close the webview nothing owns.
+                   (lambda (done)
+                     (when (and new-env done)
+                       (puthash env t (o-envs t--mgr)))
+                     (when (> (length done) n)
+                       (ignore-errors (m-wv/close (nth n done)))))))
+         (id (nth n results))
          (wv (t--webview-make
               :id id :buffer buffer :frame frame
               :last-bounds (or rect [0 0 0 0])
               :last-visible (if visible 1 0)
               :rect-fn rect-fn :env env
               :intercept-keys key-table)))
+    (when new-env
+      (puthash env t (o-envs t--mgr)))
     (o-register-wv wv)
-    (o-sync-intercept-keys wv)
     (when buffer
       (o-attach wv buffer)
       (when (and activate win)
@@ -371,7 +403,11 @@
       (kill-buffer buf)))
   (clrhash (o-buf-map t--mgr))
   (clrhash (o-wv-map t--mgr))
-  (clrhash (o-envs t--mgr)))
+  (clrhash (o-envs t--mgr))
+  (clrhash (o-streams t--mgr))
+  (when-let* ((file (o-blob-file t--mgr)))
+    (ignore-errors (delete-file file))
+    (setf (o-blob-file t--mgr) nil)))
 
 (defun t--notification-handler (_conn method params)
   (let* ((name (concat "emacs-webview2--recv-" (symbol-name method)))
@@ -395,7 +431,31 @@
              :process proc
              :notification-dispatcher #'t--notification-handler
              :on-shutdown #'t--cleanup-sentinel))
-    (setf (o-dying t--mgr) nil))))
+    (setf (o-dying t--mgr) nil)
+    (o-open-blobs))))
+
+(defun o-open-blobs ()
+  "Have the manager pass large binary results through a shared file."
+  (when (> t-blob-size 0)
+    (condition-case nil
+        (let ((res (t--srpc '$/blob/open `(:size ,t-blob-size))))
+          (setf (o-blob-file t--mgr) (map-elt res :path)))
+      (jsonrpc-error nil))))
+
+(defun o-take-bytes (res)
+  "Return the binary result RES as a unibyte string.
+RES either names a range of the shared file, which is then released,
+or carries the bytes as base64."
+  (when (consp res)
+    (if-let* ((blob (map-elt res :blob)))
+        (let ((beg (map-elt blob :offset)))
+          (prog1 (with-temp-buffer
+                   (set-buffer-multibyte nil)
+                   (insert-file-contents-literally
+                    (o-blob-file t--mgr) nil beg (+ beg (map-elt blob :length)))
+                   (buffer-string))
+            (t--say '$/blob/release `(:handles [,(map-elt blob :handle)]))))
+      (base64-decode-string (map-elt res :base64)))))
 
 (defun t--srpc (method params)
   (jsonrpc-request (o-conn t--mgr) method params))
@@ -416,19 +476,52 @@
   (setf (o-dying t--mgr) t)
   (t--say 'app/exit :jsonrpc-omit))
 
+(defun m-app/stats (&optional reset)
+  (t--srpc 'app/stats (if reset '(:reset t) :jsonrpc-omit)))
+
+(defun m-app/trace (enable &optional path)
+  (t--srpc 'app/trace `(:enable ,(if enable t :json-false)
+                        ,@(when path `(:path ,(expand-file-name path))))))
+
+(defun m-app/record (&optional path)
+  (t--srpc 'app/record (if path `(:path ,(expand-file-name path)) :jsonrpc-omit)))
+
+(defun m-app/multi (calls &optional on-error)
+  "Run CALLS, a list of (METHOD . PARAMS), in one round trip.
+PARAMS may use the result of call I (from 0) as (:$ref I), or a part
+of it as (:$ref I :pointer \"/json/pointer\").  Return the list of
+results; signal an error if a call failed, after the calls before it.
+Before signalling, call ON-ERROR with the results of those calls, so
+what they created can be kept track of or undone."
+  (let ((res (t--srpc 'app/multi
+                      (vconcat (mapcar (lambda (call)
+                                         `(:method ,(symbol-name (car call))
+                                           ,@(when (cdr call) `(:params ,(cdr call)))))
+                                       calls))))
+        (results nil))
+    (seq-doseq (outcome res)
+      (when-let* ((err (plist-get outcome :error)))
+        (when on-error
+          (funcall on-error (nreverse results)))
+        (error "WebView2 multi-call failed: %s" (plist-get err :message)))
+      (push (plist-get outcome :result) results))
+    (nreverse results)))
+
 (defun m-env/create (config)
   (t--srpc 'env/create config))
 
 (defun m-env/list-names ()
   (t--srpc 'env/list-names :jsonrpc-omit))
 
+(defun t--wv-create-params (&optional hwnd visible rect url env-name)
+  `(,@(when hwnd `(:hwnd ,hwnd))
+    ,@(when visible `(:visible ,visible))
+    ,@(when rect `(:bounds ,rect))
+    ,@(when url `(:url ,url))
+    ,@(when env-name `(:environment ,env-name))))
+
 (defun m-wv/create (&optional hwnd visible rect url env-name)
-  (let ((params `(,@(when hwnd `(:hwnd ,hwnd))
-                  ,@(when visible `(:visible ,visible))
-                  ,@(when rect `(:bounds ,rect))
-                  ,@(when url `(:url ,url))
-                  ,@(when env-name `(:environment ,env-name)))))
-    (t--srpc 'wv/create params)))
+  (t--srpc 'wv/create (t--wv-create-params hwnd visible rect url env-name)))
 
 (defun m-wv/close (id)
   (t--srpc 'wv/close `[,id]))
@@ -452,6 +545,16 @@
 (defun m-wv/get-title (id)
   (t--srpc 'wv/get-title `[,id]))
 
+(defun m-wv/get-html (id)
+  (let ((res (t--srpc 'wv/get-html `[,id])))
+    (if (and (consp res) (map-elt res :stream))
+        (o-take-stream (map-elt res :stream))
+      res)))
+
+(defun m-wv/capture (id)
+  "Return a PNG screenshot of webview ID as a unibyte string."
+  (o-take-bytes (t--srpc 'wv/capture `[,id])))
+
 (defun m-wv/set-intercept-keys (id keys)
   (t--srpc 'wv/set-intercept-keys `[,id ,keys]))
 
@@ -483,6 +586,16 @@
           (unless (string= (buffer-name) new-name)
             (rename-buffer new-name t)))))))
 
+(defun n-$/streamChunk (params)
+  (push (map-elt params :data)
+        (gethash (map-elt params :id) (o-streams t--mgr))))
+
+(defun o-take-stream (id)
+  "Return the concatenated chunks streamed for request ID and forget them."
+  (let ((chunks (gethash id (o-streams t--mgr))))
+    (remhash id (o-streams t--mgr))
+    (apply #'concat (nreverse chunks))))
+
 (defun n-wv/new-window-requested (params)
   (let* ((url (map-elt params :url)))
     (t-open-url url)))
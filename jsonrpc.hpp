@@ -4,28 +4,283 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <coroutine>
+#include <cstring>
+#include <deque>
 #include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
-#include <queue>
 #include <string>
-#include <syncstream>
+#include <string_view>
 #include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
 #include <variant>
+#include <vector>
 
 #ifdef _WIN32
 #include <fcntl.h>
 #include <io.h>
+#else
+#include <unistd.h>
 #endif
 
 #include "json.hpp"
+#include "trace.hpp"
+#include "record.hpp"
+#include "blob.hpp"
 
 namespace jsonrpc {
 
+#ifndef JSONRPC_NO_ARENA
+
+// Per-frame arena for the json values MessageDecoder creates, recycled when
+// the last of them is freed. Define JSONRPC_NO_ARENA to use plain nlohmann::json.
+
+// Allocation counters, totals since startup.
+struct AllocStats {
+    uint64_t arenas = 0;       // Frames decoded into an arena.
+    uint64_t arena_allocs = 0; // Allocations served by an arena.
+    uint64_t arena_bytes = 0;  // Bytes of those, headers included.
+    uint64_t heap_allocs = 0;  // json allocations that went to the heap.
+    uint64_t held_bytes = 0;   // Chunk bytes arenas hold now, cached ones included.
+};
+
+namespace details {
+
+inline std::atomic<uint64_t> g_arenas{ 0 };
+inline std::atomic<uint64_t> g_arena_allocs{ 0 };
+inline std::atomic<uint64_t> g_arena_bytes{ 0 };
+inline std::atomic<uint64_t> g_heap_allocs{ 0 };
+inline std::atomic<uint64_t> g_held_bytes{ 0 };
+
+class Arena {
+public:
+    static constexpr size_t kHeader = 16; // Owning Arena*, keeps 16-byte alignment.
+    static constexpr size_t kFirstChunk = 2 * 1024;
+    static constexpr size_t kMaxChunk = 32 * 1024;
+    static constexpr size_t kMaxAlloc = 8 * 1024; // Larger blocks go to the heap.
+    static constexpr size_t kKeptChunks = 4;      // Chunks kept across reuse.
+    static constexpr size_t kCacheSize = 64;      // Idle arenas kept for reuse.
+
+    // Take an arena from the cache, or make one.
+    static Arena* open() {
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex());
+            auto& c = cache();
+            if (!c.empty()) {
+                Arena* a = c.back();
+                c.pop_back();
+                a->rewind();
+                return a;
+            }
+        }
+        return new Arena();
+    }
+
+    // Stop allocating and hand the values over to their owners. Until then
+    // only the opening thread touches the arena, so allocation needs no
+    // atomic: frees are counted against a large bias that close() settles.
+    void close() {
+        g_arenas.fetch_add(1, std::memory_order_relaxed);
+        g_arena_allocs.fetch_add(allocs_, std::memory_order_relaxed);
+        g_arena_bytes.fetch_add(bytes_, std::memory_order_relaxed);
+        int64_t live = (int64_t)allocs_ - kBias;
+        if (refs_.fetch_add(live, std::memory_order_acq_rel) + live == 0) {
+            recycle();
+        }
+    }
+
+    // Size includes the header and is a multiple of 16.
+    void* allocate(size_t size) {
+        if ((size_t)(end_ - cur_) < size) grow(size);
+        void* p = cur_;
+        cur_ += size;
+        allocs_++;
+        bytes_ += size;
+        return p;
+    }
+
+    void release() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            recycle();
+        }
+    }
+
+private:
+    static constexpr int64_t kBias = int64_t(1) << 62;
+
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::atomic<int64_t> refs_{ kBias };
+    std::vector<Chunk> chunks_;
+    size_t chunk_ = 0; // Index of the chunk being filled, if any.
+    char* cur_ = nullptr;
+    char* end_ = nullptr;
+    uint64_t allocs_ = 0;
+    uint64_t bytes_ = 0;
+
+    // Never destroyed, so values freed during static destruction still
+    // find them.
+    static std::mutex& cache_mutex() {
+        static auto* m = new std::mutex;
+        return *m;
+    }
+    static std::vector<Arena*>& cache() {
+        static auto* c = new std::vector<Arena*>;
+        return *c;
+    }
+
+    void grow(size_t size) {
+        // Move on to the next kept chunk that fits, else add one.
+        size_t next = cur_ ? chunk_ + 1 : 0;
+        while (next < chunks_.size() && chunks_[next].size < size) next++;
+        if (next == chunks_.size()) {
+            size_t n = chunks_.empty() ? kFirstChunk : (std::min)(chunks_.back().size * 2, kMaxChunk);
+            n = (std::max)(n, size);
+            chunks_.push_back({ std::make_unique<char[]>(n), n });
+            g_held_bytes.fetch_add(n, std::memory_order_relaxed);
+        }
+        chunk_ = next;
+        cur_ = chunks_[chunk_].data.get();
+        end_ = cur_ + chunks_[chunk_].size;
+    }
+
+    void rewind() {
+        refs_.store(kBias, std::memory_order_relaxed);
+        chunk_ = 0;
+        cur_ = end_ = nullptr;
+        allocs_ = bytes_ = 0;
+    }
+
+    void recycle() {
+        if (chunks_.size() > kKeptChunks) {
+            drop_chunks(kKeptChunks);
+        }
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex());
+            if (cache().size() < kCacheSize) {
+                cache().push_back(this);
+                return;
+            }
+        }
+        drop_chunks(0);
+        delete this;
+    }
+
+    void drop_chunks(size_t keep) {
+        size_t n = 0;
+        for (size_t i = keep; i < chunks_.size(); i++) n += chunks_[i].size;
+        chunks_.resize(keep);
+        g_held_bytes.fetch_sub(n, std::memory_order_relaxed);
+    }
+};
+
+// The arena json allocations on this thread go to, if any.
+inline thread_local Arena* t_arena = nullptr;
+
+inline void* arena_allocate(size_t bytes) {
+    size_t size = Arena::kHeader + ((bytes + 15) & ~size_t(15));
+    Arena* a = t_arena;
+    void* block;
+    if (a && size <= Arena::kMaxAlloc) {
+        block = a->allocate(size);
+    } else {
+        block = ::operator new(size);
+        a = nullptr;
+        g_heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    }
+    *static_cast<Arena**>(block) = a;
+    return static_cast<char*>(block) + Arena::kHeader;
+}
+
+inline void arena_deallocate(void* p) noexcept {
+    char* block = static_cast<char*>(p) - Arena::kHeader;
+    Arena* a = *reinterpret_cast<Arena**>(block);
+    if (a) {
+        a->release();
+    } else {
+        ::operator delete(block);
+    }
+}
+
+} // namespace details
+
+// Routes json allocations made inside an ArenaScope to its arena.
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    ArenaAllocator() noexcept = default;
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= details::Arena::kHeader, "over-aligned type");
+        return static_cast<T*>(details::arena_allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t) noexcept { details::arena_deallocate(p); }
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>&, const ArenaAllocator<U>&) noexcept { return true; }
+
+// Opens an arena for the json values created on this thread until the
+// end of the scope. Scopes nest; the inner one wins. A value moved out of
+// the scope holds its whole arena until freed, while a copy made outside
+// goes to the heap, so copy the values kept for long.
+class ArenaScope {
+public:
+    ArenaScope() : arena_(details::Arena::open()), prev_(details::t_arena) {
+        details::t_arena = arena_;
+    }
+    ~ArenaScope() {
+        details::t_arena = prev_;
+        arena_->close();
+    }
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+private:
+    details::Arena* arena_;
+    details::Arena* prev_;
+};
+
+inline AllocStats alloc_stats() {
+    AllocStats s;
+    s.arenas = details::g_arenas.load(std::memory_order_relaxed);
+    s.arena_allocs = details::g_arena_allocs.load(std::memory_order_relaxed);
+    s.arena_bytes = details::g_arena_bytes.load(std::memory_order_relaxed);
+    s.heap_allocs = details::g_heap_allocs.load(std::memory_order_relaxed);
+    s.held_bytes = details::g_held_bytes.load(std::memory_order_relaxed);
+    return s;
+}
+
+using json = nlohmann::basic_json<std::map, std::vector, std::string, bool, std::int64_t, std::uint64_t,
+                                  double, ArenaAllocator>;
+
+#else
+
 using json = nlohmann::json;
 
+#endif // JSONRPC_NO_ARENA
+
 // Namespace for JSON-RPC 2.0 specifications and constants.
 namespace spec {
 
@@ -47,12 +302,18 @@ constexpr int kInvalidRequest = -32600;
 constexpr int kMethodNotFound = -32601;
 constexpr int kInvalidParams  = -32602;
 constexpr int kInternalError  = -32603;
+// LSP extension: reply to a request cancelled with $/cancelRequest.
+constexpr int kRequestCancelled = -32800;
+// Given to the callback of a request the peer did not answer in time.
+constexpr int kRequestTimeout = -32001;
 
 constexpr const char* msg_ParseError     = "Parse Error";
 constexpr const char* msg_InvalidRequest = "Invalid Request";
 constexpr const char* msg_MethodNotFound = "Method not found";
 constexpr const char* msg_InvalidParams  = "Invalid params";
 constexpr const char* msg_InternalError  = "Internal error";
+constexpr const char* msg_RequestCancelled = "Request cancelled";
+constexpr const char* msg_RequestTimeout = "Request timed out";
 
 // Detailed error messages for internal validation usage.
 namespace details {
@@ -75,6 +336,7 @@ constexpr const char* parse_not_object       = "Invalid JSON-RPC: not an object"
 constexpr const char* parse_id_null_no_error = "Invalid JSON-RPC: id is null but no error object";
 constexpr const char* parse_id_type          = "Invalid JSON-RPC: id must be integer or null";
 constexpr const char* parse_broken           = "Invalid JSON-RPC: Message must have method or id";
+constexpr const char* parse_empty_batch      = "Invalid JSON-RPC: empty batch";
 
 } // namespace details
 
@@ -105,6 +367,11 @@ struct JsonRpcException : public std::runtime_error {
         : std::runtime_error(code_to_message(c)), code(c), data(std::move(d)) {}
 };
 
+// Ids are ints: an integer outside that range is rejected, not truncated.
+inline bool is_int_id(const json& v) {
+    return v.is_number_integer() && v >= INT_MIN && v <= INT_MAX;
+}
+
 // Represents a JSON-RPC Error object.
 // Used inside Response or as a standalone message for null id cases.
 struct Error {
@@ -166,7 +433,7 @@ struct Request {
         // 1. Parse id.
         if (j.contains("id")) {
             const auto& id_val = j["id"];
-            if (id_val.is_number_integer()) {
+            if (is_int_id(id_val)) {
                 r.id = id_val.get<int>();
             } else {
                 throw JsonRpcException(spec::kInvalidRequest, spec::details::req_id_type);
@@ -229,7 +496,7 @@ struct Response {
         }
         const auto& id_val = j["id"];
 
-        if (id_val.is_number_integer()) {
+        if (is_int_id(id_val)) {
             r.id = id_val.get<int>();
         } else {
             // Parser handles "id: null" logic, so here it must be int.
@@ -273,7 +540,7 @@ struct Parser {
         if (j.contains("id")) {
             const auto& id_val = j["id"];
             // Normal Response
-            if (id_val.is_number_integer()) {
+            if (is_int_id(id_val)) {
                 return j.get<Response>();
             }
             // Protocol Error (id is null).
@@ -293,307 +560,3236 @@ struct Parser {
         return parse(json::parse(str));
     }
 };
-}  // namespace jsonrpc
-
-// Code for stdio-based JSON-RPC connection handling.
-namespace jsonrpc {
-
-// Thread-safe queue for buffering incoming messages from the reader thread.
-template <typename T>
-class ThreadSafeQueue {
-private:
-    std::queue<T> queue_;
-    std::mutex mutex_;
 
-public:
-    void push(T value) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        queue_.push(std::move(value));
-    }
-    bool try_pop(T& value) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (queue_.empty()) return false;
-        value = std::move(queue_.front());
-        queue_.pop();
-        return true;
+// Encoding of a frame body. JSON is the default and is what Emacs speaks.
+// A frame carrying CBOR or MessagePack says so with a Content-Type header;
+// which encoding we send is negotiated with $/setEncoding.
+enum class Encoding : uint8_t { Json, Cbor, MsgPack };
+
+// Content-Type header value for enc, empty for JSON (no header is sent).
+inline std::string_view content_type(Encoding enc) {
+    switch (enc) {
+    case Encoding::Cbor:    return "application/cbor";
+    case Encoding::MsgPack: return "application/msgpack";
+    default:                return {};
     }
-};
+}
 
-class Conn; // Forward declaration.
+// Maps a Content-Type header value to an encoding. Parameters such as
+// "; charset=utf-8" are ignored and unknown media types are read as JSON.
+inline Encoding encoding_from_content_type(std::string_view value) {
+    value = value.substr(0, value.find(';'));
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+    auto is = [value](std::string_view type) {
+        return std::equal(value.begin(), value.end(), type.begin(), type.end(),
+                          [](char a, char b) { return std::tolower((unsigned char)a) == b; });
+    };
+    if (is("application/cbor")) return Encoding::Cbor;
+    if (is("application/msgpack") || is("application/x-msgpack")) return Encoding::MsgPack;
+    return Encoding::Json;
+}
 
-// Context passed to async request handlers.
-// Allows handlers to reply or send errors asynchronously.
-class Context {
-public:
-    Context(Conn& c, std::optional<int> i) : conn_(c), id_(i) {}
+// Maps the encoding names accepted by $/setEncoding.
+inline std::optional<Encoding> encoding_from_name(std::string_view name) {
+    if (name == "json") return Encoding::Json;
+    if (name == "cbor") return Encoding::Cbor;
+    if (name == "msgpack") return Encoding::MsgPack;
+    return std::nullopt;
+}
 
-    void reply(json result);
-    void error(int code, std::string message, json data = nullptr);
+// Result of a non-throwing decode. code is 0 on success, otherwise a
+// JSON-RPC error code with a static description in message.
+struct DecodeStatus {
+    int code = 0;
+    const char* message = nullptr;
 
-    std::optional<int> id() const { return id_; }
-    bool is_notification() const { return !id_.has_value(); }
+    bool ok() const { return code == 0; }
+};
 
-private:
-    Conn& conn_;
-    std::optional<int> id_;
+// Messages decoded from one frame. A single message yields one entry in
+// messages. A batch yields one entry per valid element and one status per
+// invalid element in errors.
+struct DecodedFrame {
+    bool batch = false;
+    std::vector<IncomingMessage> messages;
+    std::vector<DecodeStatus> errors;
+
+    void clear() {
+        batch = false;
+        messages.clear();
+        errors.clear();
+    }
 };
 
-// The main connection class that manages the JSON-RPC communication.
-// Implements the "LSP-style" Content-Length framing over Stdin/Stdout.
-// Typically used to integrate with Emacs's jsonrpc.el.
-class Conn {
+// Streaming decoder built on json::sax_parse.
+// Fills Request/Response/Error directly from SAX events instead of building
+// a DOM and walking it with from_json. Only the params/result/error payloads
+// are materialized as json values, and they are moved into the message.
+// Validation follows Parser::parse, but reports failures as DecodeStatus.
+// A top-level array is decoded as a JSON-RPC batch, element by element.
+// CBOR and MessagePack bodies produce the same SAX events and share the path.
+// The payloads of each frame are allocated from one arena (see ArenaScope).
+// An instance keeps its scratch buffers, so reuse it for a stream of messages.
+class MessageDecoder {
 public:
-    using AsyncRequestHandler = std::function<void(Context, const json&)>;
-    using RequestHandler      = std::function<json(const json&)>;
-    using ResponseHandler     = std::function<void(const Response&)>;
-    using NotificationHandler = std::function<void(const json&)>;
-    using RawHandler          = std::function<bool(const IncomingMessage&, Conn&)>;
-    using Waker               = std::function<void()>;
-
-    // Default Max Package Size: 16MB
-    static constexpr size_t kDefaultMaxContentLength = 16 * 1024 * 1024;
+    // Decode a frame holding either a single message or a batch.
+    // A failed single message is reported through the return value. Invalid
+    // batch elements are reported in out.errors and do not fail the frame.
+    DecodeStatus decode(std::string_view text, DecodedFrame& out, Encoding enc = Encoding::Json) {
+        return decode(text.data(), text.data() + text.size(), out, enc);
+    }
 
-    // Constructor: waker is called whenever a new message arrives in the queue.
-    // Use it to wake up your main event loop.
-    Conn(Waker waker,
-        std::istream& input = std::cin,
-        std::ostream& output = std::cout,
-        std::ostream& error = std::cerr,
-        size_t max_pkg_size = kDefaultMaxContentLength)
-        : running_(false), next_id_(1), waker_(waker),
-        in_(input), out_(output), err_(error), max_content_length_(max_pkg_size) {
-        // Force Windows stdin/stdout into binary mode to prevent \r\n translation.
-        // Critical for correct Content-Length calculation.
-#ifdef _WIN32
-        if (&input == &std::cin) {
-            (void)_setmode(_fileno(stdin), _O_BINARY);
+    // Same, reading the frame from a pair of input iterators such as
+    // FrameReader::BodyIterator, so a body is decoded while it arrives.
+    template <typename InputIt>
+    DecodeStatus decode(InputIt first, InputIt last, DecodedFrame& out, Encoding enc = Encoding::Json) {
+        reset();
+        out.clear();
+        out_ = &out;
+        bool parsed;
+        {
+#ifndef JSONRPC_NO_ARENA
+            ArenaScope arena;
+#endif
+            parsed = json::sax_parse(first, last, this, input_format(enc));
         }
-        if (&output == &std::cout) {
-            (void)_setmode(_fileno(stdout), _O_BINARY);
+        out_ = nullptr;
+        if (!parsed) {
+            out.clear();
+            return { spec::kParseError, spec::msg_ParseError };
         }
-        if (&error == &std::cerr) {
-            (void)_setmode(_fileno(stderr), _O_BINARY);
+        if (!out.batch) {
+            if (!out.errors.empty()) {
+                DecodeStatus st = out.errors.front();
+                out.errors.clear();
+                return st;
+            }
+            return {};
         }
-#endif
+        if (out.messages.empty() && out.errors.empty()) {
+            return { spec::kInvalidRequest, spec::details::parse_empty_batch };
+        }
+        return {};
     }
 
-    ~Conn() { stop(); }
-
-    // Check whether the Connection is running or not.
-    bool is_running() const {
-        return running_;
+    // Decode a frame that must hold a single message.
+    DecodeStatus decode(std::string_view text, IncomingMessage& out, Encoding enc = Encoding::Json) {
+        DecodeStatus st = decode(text, scratch_, enc);
+        if (!st.ok()) return st;
+        if (scratch_.batch) {
+            return { spec::kInvalidRequest, spec::details::parse_not_object };
+        }
+        out = std::move(scratch_.messages.front());
+        return {};
     }
 
-    // Start the background reader thread.
-    void start() {
-        if (running_) return;
-        running_ = true;
-        // Start the reader thread that continuously reads from stdin
-        // and pushes messages to the inbox queue.
-        reader_thread_ = std::thread([this]() { read_loop(); });
+    // SAX interface.
+    bool null() { return scalar(nullptr, Kind::Null); }
+    bool boolean(bool v) { return scalar(v, Kind::Other); }
+    bool number_integer(json::number_integer_t v) {
+        if (at_member() && field_ == Field::Id) {
+            // Out of int range: not truncated, reported as a wrong id type.
+            if (v < INT_MIN || v > INT_MAX) return scalar(v, Kind::Other);
+            id_ = (int)v;
+        }
+        return scalar(v, Kind::Integer);
     }
-
-    // Stop the reader thread and cleanup.
-    void stop() {
-        running_ = false;
-        if (reader_thread_.joinable()) {
-            reader_thread_.join();
+    bool number_unsigned(json::number_unsigned_t v) {
+        if (at_member() && field_ == Field::Id) {
+            if (v > (json::number_unsigned_t)INT_MAX) return scalar(v, Kind::Other);
+            id_ = (int)v;
         }
+        return scalar(v, Kind::Integer);
     }
-
-    // Set a raw handler to intercept all incoming messages (advanced usage).
-    // If the handler returns true, the message is considered handled and won't
-    // be processed further.
-    void set_raw_handler(RawHandler handler) {
-        if (running_) {
-            throw std::runtime_error("JSON-RPC Error: Cannot register methods after server start");
+    bool number_float(json::number_float_t v, const json::string_t&) { return scalar(v, Kind::Other); }
+    bool string(json::string_t& v) {
+        if (at_member() && field_ == Field::Method) {
+            method_ = std::move(v);
+            return scalar(nullptr, Kind::String);
         }
-        raw_handler_ = std::move(handler);
+        return scalar(std::move(v), Kind::String);
     }
+    bool binary(json::binary_t& v) { return scalar(std::move(v), Kind::Other); }
 
-    // Register an async method.
-    void register_async_method(const std::string& name, AsyncRequestHandler handler) {
-        if (running_) {
-            throw std::runtime_error("JSON-RPC Error: Cannot register methods after server start");
+    bool start_object(std::size_t) {
+        if (skip_ > 0) {
+            ++skip_;
+            ++depth_;
+            return true;
+        }
+        if (depth_++ == base_) {
+            begin_element();
+            return true;
         }
-        method_handlers_[name] = handler;
+        return open(json::value_t::object);
     }
-
-    // Register a sync method.
-    // Wraps the sync handler into an async one.
-    void register_method(const std::string& name, RequestHandler handler) {
-        register_async_method(name, [handler](Context ctx, const json& params) {
-            try {
-                // Call user logic, get result, reply immediately
-                json res = handler(params);
-                ctx.reply(std::move(res));
-            } catch (const JsonRpcException& e) {
-                // Allow handler to throw JsonRpcException directly.
-                ctx.error(e.code, e.what(), e.data);
-            } catch (const std::exception& e) {
-                // Catch generic exceptions as Internal Error.
-                ctx.error(spec::kInternalError, e.what());
-            }
-            });
+    bool key(json::string_t& k) {
+        if (skip_ > 0) return true;
+        if (depth_ == base_ + 1) {
+            field_ = field_of(k);
+            return true;
+        }
+        key_ = std::move(k);
+        return true;
     }
-
-    // Register a notification handler.
-    void register_notification(const std::string& name, NotificationHandler handler) {
-        register_async_method(name, [handler](Context ctx, const json& params) {
-            if (ctx.is_notification()) {
-                handler(params);
-            } else {
-                ctx.error(spec::kInvalidRequest, "Notification handler expects no id");
-            }
-            });
+    bool end_object() { return close(); }
+    bool start_array(std::size_t) {
+        if (skip_ > 0) {
+            ++skip_;
+            ++depth_;
+            return true;
+        }
+        if (depth_ == 0) {
+            // Top-level array: a batch of messages.
+            out_->batch = true;
+            base_ = depth_ = 1;
+            return true;
+        }
+        if (depth_++ == base_) {
+            out_->errors.push_back({ spec::kInvalidRequest, spec::details::parse_not_object });
+            skip_ = 1;
+            return true;
+        }
+        return open(json::value_t::array);
+    }
+    bool end_array() { return close(); }
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) {
+        return false;
     }
 
-    // Send a Request to the other side, with a callback for the response.
-    void send_request(const std::string& method, const json& params, ResponseHandler callback) {
-        int id = next_id_++;
-        {
-            std::lock_guard<std::mutex> lock(callback_mutex_);
-            pending_callbacks_[id] = callback;
+private:
+    enum class Field { None, Id, Method, Params, Result, Error };
+    enum class Kind { Absent, Null, Integer, String, Structured, Other };
+
+    DecodedFrame* out_ = nullptr;
+    DecodedFrame scratch_;
+    int depth_ = 0;
+    int base_ = 0; // Depth of message objects: 0 for a single message, 1 in a batch.
+    bool in_element_ = false;
+    Field field_ = Field::None;
+    int skip_ = 0; // Nesting depth of an ignored value.
+
+    Kind id_kind_ = Kind::Absent;
+    Kind method_kind_ = Kind::Absent;
+    Kind params_kind_ = Kind::Absent;
+    bool has_result_ = false;
+    bool has_error_ = false;
+    int id_ = 0;
+    std::string method_;
+    json params_;
+    json result_;
+    json error_;
+
+    // Builder state for the payload currently being decoded.
+    json* root_ = nullptr;
+    std::vector<json*> stack_;
+    json::string_t key_;
+
+    static nlohmann::detail::input_format_t input_format(Encoding enc) {
+        switch (enc) {
+        case Encoding::Cbor:    return nlohmann::detail::input_format_t::cbor;
+        case Encoding::MsgPack: return nlohmann::detail::input_format_t::msgpack;
+        default:                return nlohmann::detail::input_format_t::json;
         }
-        Request req{ id, method, params };
-        json j;
-        to_json(j, req);
-        send_message(j.dump());
     }
 
-    // Send a notification to other side.
-    void send_notification(const std::string& method, const json& params = nullptr) {
-        Request req{ std::nullopt, method, params };
-        json j;
-        to_json(j, req);
-        send_message(j.dump());
+    void reset() {
+        depth_ = 0;
+        base_ = 0;
+        in_element_ = false;
+        skip_ = 0;
+        reset_element();
     }
 
-    // Public method to reply with success (used by Context).
-    void send_response_success(int id, json result) {
-        json j;
-        to_json(j, Response::make_success(id, std::move(result)));
-        send_message(j.dump());
+    void reset_element() {
+        field_ = Field::None;
+        id_kind_ = method_kind_ = params_kind_ = Kind::Absent;
+        has_result_ = has_error_ = false;
+        id_ = 0;
+        method_.clear();
+        params_ = nullptr;
+        result_ = nullptr;
+        error_ = nullptr;
+        root_ = nullptr;
+        stack_.clear();
     }
-    // Public method to reply with error (used by COntext).
-    void send_response_error(int id, int code, std::string msg, json data = nullptr) {
-        json j;
-        to_json(j, Response::make_error(id, code, std::move(msg), std::move(data)));
-        send_message(j.dump());
+
+    void begin_element() {
+        reset_element();
+        in_element_ = true;
     }
 
-    // Main Loop Processor: Call this from your main thread/event loop.
-    // It processes messages from the inbox queue.
-    void process_queue() {
+    void end_element() {
+        in_element_ = false;
         IncomingMessage msg;
-        while (inbox_.try_pop(msg)) {
-            // 1. Raw Handler Interception.
-            if (raw_handler_ && raw_handler_(msg, *this)) {
-                continue;
-            }
-            // 2. Dispatch based on message type.
-            std::visit([this](auto&& arg) {
-                using T = std::decay_t<decltype(arg)>;
-                if constexpr (std::is_same_v<T, Request>) {
-                    handle_request(arg);
-                } else if constexpr (std::is_same_v<T, Response>) {
-                    handle_response(arg);
-                } else if constexpr (std::is_same_v<T, Error>) {
-                    // Handle "Global Error", usually a Protocol Error from peer.
-                    // Log to stderr as it cannot be replied to.
-                    err_ << "[JSON-RPC FATAL ERROR] Code: " << arg.code
-                        << ", Message: " << arg.message << std::endl;
-                    if (!arg.data.is_null()) {
-                        err_ << "Data: " << arg.data.dump() << std::endl;
-                    }
-                }
-            }, msg);
+        DecodeStatus st = finish(msg);
+        if (st.ok()) {
+            out_->messages.push_back(std::move(msg));
+        } else {
+            out_->errors.push_back(st);
         }
     }
 
-private:
-    std::atomic<bool> running_;
-    std::atomic<int> next_id_;
-    std::thread reader_thread_;
-    Waker waker_;
-
-    size_t max_content_length_;
-
-    ThreadSafeQueue<IncomingMessage> inbox_;
-    std::mutex callback_mutex_;
-    RawHandler raw_handler_;
-    std::map<std::string, AsyncRequestHandler> method_handlers_;
-    std::map<int, ResponseHandler> pending_callbacks_;
-
-    std::istream& in_;
-    std::ostream& out_;
-    std::ostream& err_;
+    // True while positioned at a member value of the message object.
+    bool at_member() const {
+        return in_element_ && skip_ == 0 && depth_ == base_ + 1;
+    }
 
-    // Thread-safe message sender.
-    void send_message(const std::string& body) {
-        // std::osyncstream will atomically write the buffer to the stream
-        // when it is destructed, so we don't need to manually lock.
+    static Field field_of(std::string_view k) {
+        if (k == "id") return Field::Id;
+        if (k == "method") return Field::Method;
+        if (k == "params") return Field::Params;
+        if (k == "result") return Field::Result;
+        if (k == "error") return Field::Error;
+        return Field::None;
+    }
 
-        // Emacs's jsonrpc use a HTTP-like framing with Content-Length header,
-        // Content-Length: <length>\r\n\r\n<body>
-        std::osyncstream(out_)
-            << "Content-Length: " << body.length() << "\r\n"
-            << "\r\n" << body << std::flush;
+    // Select the payload target for a member value.
+    json* target_for(Field f) {
+        switch (f) {
+        case Field::Params: return &params_;
+        case Field::Result: has_result_ = true; return &result_;
+        case Field::Error:  has_error_ = true; return &error_;
+        default:            return nullptr;
+        }
     }
 
-    // Helper: Send a protocol-level error where id is null.
-    // Used when we cannot parse the request or the ID is invalid.
-    void send_protocol_error(int code, std::string msg, json data = nullptr) {
-        json j = json{
-            {"jsonrpc", "2.0"},
-            {"id", nullptr}, // Must be null for protocol errors.
-            {"error", {{"code", code}, {"message", msg}}}
-        };
-        if (!data.is_null()) {
-            j["error"]["data"] = data;
+    // Insert a value into the payload under construction.
+    json* insert(json&& v) {
+        if (stack_.empty()) {
+            *root_ = std::move(v);
+            return root_;
+        }
+        json& parent = *stack_.back();
+        if (parent.is_array()) {
+            auto& arr = parent.get_ref<json::array_t&>();
+            arr.emplace_back(std::move(v));
+            return &arr.back();
         }
-        send_message(j.dump());
+        json& slot = parent.get_ref<json::object_t&>()[std::move(key_)];
+        slot = std::move(v);
+        return &slot;
     }
 
-    void handle_request(const Request& req) {
-        AsyncRequestHandler handler;
-        if (method_handlers_.count(req.method)) {
-            handler = method_handlers_[req.method];
+    void note_kind(Kind k) {
+        if (field_ == Field::Id) id_kind_ = k;
+        else if (field_ == Field::Method) method_kind_ = k;
+        else if (field_ == Field::Params) params_kind_ = k;
+    }
+
+    template <typename T>
+    bool scalar(T&& v, Kind k) {
+        if (skip_ > 0) return true;
+        if (depth_ == base_) {
+            // A scalar where a message object was expected.
+            out_->errors.push_back({ spec::kInvalidRequest, spec::details::parse_not_object });
+            return true;
+        }
+        if (depth_ == base_ + 1) {
+            note_kind(k);
+            root_ = target_for(field_);
+            if (!root_) return true;
+            stack_.clear();
+        } else if (!root_) {
+            return true;
         }
+        insert(json(std::forward<T>(v)));
+        return true;
+    }
 
-        if (handler) {
-            try {
-                // Pass Context to handler. It is responsible for replying.
-                handler(Context(*this, req.id), req.params);
-            } catch (const JsonRpcException& e) {
-                if (req.id.has_value()) {
-                    send_response_error(req.id.value(), e.code, e.what(), e.data);
-                }
-            } catch (const std::exception& e) {
-                // User threw a generic exception -> Internal Error
-                if (req.id.has_value()) {
-                    send_response_error(req.id.value(), spec::kInternalError, e.what());
-                }
-            }
-        } else {
-            // Method not found.
-            if (req.id.has_value()) {
-                send_response_error(req.id.value(), spec::kMethodNotFound, spec::msg_MethodNotFound, req.method);
+    // Open a container inside a message; depth_ is already incremented.
+    bool open(json::value_t type) {
+        if (depth_ == base_ + 2) {
+            // Value of a message member.
+            note_kind(Kind::Structured);
+            root_ = target_for(field_);
+            if (!root_) {
+                skip_ = 1;
+                return true;
             }
+            stack_.clear();
         }
+        stack_.push_back(insert(json(type)));
+        return true;
     }
 
-    void handle_response(const Response& resp) {
-        ResponseHandler callback = nullptr;
-        {
-            std::lock_guard<std::mutex> lock(callback_mutex_);
-            auto it = pending_callbacks_.find(resp.id);
-            if (it != pending_callbacks_.end()) {
-                callback = std::move(it->second);
-                pending_callbacks_.erase(it);
-            }
+    bool close() {
+        --depth_;
+        if (skip_ > 0) {
+            --skip_;
+        } else if (depth_ == base_ && in_element_) {
+            end_element();
+        } else if (!stack_.empty()) {
+            stack_.pop_back();
+        }
+        return true;
+    }
+
+    // Non-throwing counterpart of from_json(const json&, Error&).
+    static DecodeStatus take_error(json& j, Error& e) {
+        if (!j.is_object()) {
+            return { spec::kInternalError, spec::details::err_code_miss };
+        }
+        auto& obj = j.get_ref<json::object_t&>();
+        auto code = obj.find("code");
+        if (code == obj.end()) {
+            return { spec::kInternalError, spec::details::err_code_miss };
+        }
+        if (!code->second.is_number_integer()) {
+            return { spec::kInternalError, spec::details::err_code_type };
+        }
+        e.code = code->second.get<int>();
+        auto msg = obj.find("message");
+        if (msg == obj.end()) {
+            return { spec::kInternalError, spec::details::err_msg_miss };
+        }
+        if (!msg->second.is_string()) {
+            return { spec::kInternalError, spec::details::err_msg_type };
+        }
+        e.message = std::move(msg->second.get_ref<std::string&>());
+        auto data = obj.find("data");
+        e.data = data != obj.end() ? std::move(data->second) : json(nullptr);
+        return {};
+    }
+
+    DecodeStatus finish(IncomingMessage& out) {
+        // Case 1: Request or Notification.
+        if (method_kind_ != Kind::Absent) {
+            Request req;
+            if (id_kind_ == Kind::Integer) {
+                req.id = id_;
+            } else if (id_kind_ != Kind::Absent) {
+                return { spec::kInvalidRequest, spec::details::req_id_type };
+            }
+            if (method_kind_ != Kind::String) {
+                return { spec::kInvalidRequest, spec::details::req_method_miss };
+            }
+            req.method = std::move(method_);
+            if (params_kind_ != Kind::Absent && params_kind_ != Kind::Structured && params_kind_ != Kind::Null) {
+                return { spec::kInvalidRequest, spec::details::req_params_type };
+            }
+            req.params = std::move(params_);
+            out = std::move(req);
+            return {};
+        }
+        // Case 2: Response or Protocol Error.
+        if (id_kind_ == Kind::Integer) {
+            if (has_result_ && has_error_) {
+                return { spec::kInvalidRequest, spec::details::resp_conflict };
+            }
+            if (!has_result_ && !has_error_) {
+                return { spec::kInvalidRequest, spec::details::resp_incomplete };
+            }
+            Response resp;
+            resp.id = id_;
+            if (has_error_) {
+                Error e;
+                if (auto st = take_error(error_, e); !st.ok()) return st;
+                resp.content = std::move(e);
+            } else {
+                resp.content = std::move(result_);
+            }
+            out = std::move(resp);
+            return {};
+        }
+        if (id_kind_ == Kind::Null) {
+            if (!has_error_) {
+                return { spec::kInvalidRequest, spec::details::parse_id_null_no_error };
+            }
+            Error e;
+            if (auto st = take_error(error_, e); !st.ok()) return st;
+            out = std::move(e);
+            return {};
+        }
+        if (id_kind_ != Kind::Absent) {
+            return { spec::kInvalidRequest, spec::details::parse_id_type };
+        }
+        return { spec::kInvalidRequest, spec::details::parse_broken };
+    }
+};
+
+// Length-prefixed headers of the binary encodings, written big-endian.
+namespace details {
+
+inline void append_be(std::string& out, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i) {
+        out.push_back((char)(uint8_t)(v >> (8 * i)));
+    }
+}
+
+// CBOR initial byte for a major type and its argument.
+inline void append_cbor_head(std::string& out, uint8_t major, uint64_t n) {
+    if (n < 24) {
+        out.push_back((char)(major | n));
+    } else if (n <= 0xFF) {
+        out.push_back((char)(major | 24));
+        append_be(out, n, 1);
+    } else if (n <= 0xFFFF) {
+        out.push_back((char)(major | 25));
+        append_be(out, n, 2);
+    } else if (n <= 0xFFFFFFFF) {
+        out.push_back((char)(major | 26));
+        append_be(out, n, 4);
+    } else {
+        out.push_back((char)(major | 27));
+        append_be(out, n, 8);
+    }
+}
+
+// MessagePack header: fix form when n fits `fix_max`, else 1/2/4-byte forms.
+// A zero `op8` means the type has no 1-byte length form (arrays and maps).
+inline void append_msgpack_head(std::string& out, uint8_t fix, uint64_t fix_max,
+                                uint8_t op8, uint8_t op16, uint8_t op32, uint64_t n) {
+    if (n <= fix_max) {
+        out.push_back((char)(fix | n));
+    } else if (op8 && n <= 0xFF) {
+        out.push_back((char)op8);
+        append_be(out, n, 1);
+    } else if (n <= 0xFFFF) {
+        out.push_back((char)op16);
+        append_be(out, n, 2);
+    } else {
+        out.push_back((char)op32);
+        append_be(out, n, 4);
+    }
+}
+
+inline void append_array_head(std::string& out, Encoding enc, size_t n) {
+    if (enc == Encoding::Cbor) append_cbor_head(out, 0x80, n);
+    else append_msgpack_head(out, 0x90, 15, 0, 0xDC, 0xDD, n);
+}
+
+inline void append_map_head(std::string& out, Encoding enc, size_t n) {
+    if (enc == Encoding::Cbor) append_cbor_head(out, 0xA0, n);
+    else append_msgpack_head(out, 0x80, 15, 0, 0xDE, 0xDF, n);
+}
+
+inline void append_string(std::string& out, Encoding enc, std::string_view str) {
+    if (enc == Encoding::Cbor) append_cbor_head(out, 0x60, str.size());
+    else append_msgpack_head(out, 0xA0, 31, 0xD9, 0xDA, 0xDB, str.size());
+    out.append(str);
+}
+
+} // namespace details
+
+// Encodes outgoing messages straight into a reusable frame buffer.
+// The JSON-RPC envelope is written by hand and the payload is dumped by the
+// json serializer into the same buffer, so no temporary DOM or string is
+// built. Room for the Content-Length header is reserved up front and the
+// header is back-patched right-aligned against the body once its length is
+// known. The returned view covers header and body, and stays valid until
+// the next call on the same encoder.
+// In CBOR or MessagePack mode the envelope is written with the binary
+// headers above, payloads go through json::to_cbor/to_msgpack, and the
+// frame carries a Content-Type header.
+class FrameEncoder {
+public:
+    FrameEncoder() : serializer_(nlohmann::detail::output_adapter<char, std::string>(buf_), ' ') {}
+
+    FrameEncoder(const FrameEncoder&) = delete;
+    FrameEncoder& operator=(const FrameEncoder&) = delete;
+
+    // Encoding of the frames built from now on.
+    void set_encoding(Encoding enc) { encoding_ = enc; }
+    Encoding encoding() const { return encoding_; }
+
+    // Request (with id) or notification (without id).
+    std::string_view request(std::optional<int> id, std::string_view method, const json& params) {
+        begin();
+        if (encoding_ != Encoding::Json) {
+            details::append_map_head(buf_, encoding_, 2 + id.has_value() + !params.is_null());
+            bin_key("jsonrpc");
+            details::append_string(buf_, encoding_, "2.0");
+            if (id.has_value()) {
+                bin_key("id");
+                bin_value(id.value());
+            }
+            bin_key("method");
+            details::append_string(buf_, encoding_, method);
+            if (!params.is_null()) {
+                bin_key("params");
+                bin_value(params);
+            }
+            return finish();
+        }
+        buf_.append(R"({"jsonrpc":"2.0",)");
+        if (id.has_value()) {
+            buf_.append(R"("id":)");
+            append_int(id.value());
+            buf_.push_back(',');
+        }
+        buf_.append(R"("method":)");
+        append_string(method);
+        if (!params.is_null()) {
+            buf_.append(R"(,"params":)");
+            serializer_.dump(params, false, false, 0);
+        }
+        buf_.push_back('}');
+        return finish();
+    }
+
+    // Success response.
+    std::string_view result(int id, const json& result) {
+        begin();
+        if (encoding_ != Encoding::Json) {
+            details::append_map_head(buf_, encoding_, 3);
+            bin_key("jsonrpc");
+            details::append_string(buf_, encoding_, "2.0");
+            bin_key("id");
+            bin_value(id);
+            bin_key("result");
+            bin_value(result);
+            return finish();
+        }
+        buf_.append(R"({"jsonrpc":"2.0","id":)");
+        append_int(id);
+        buf_.append(R"(,"result":)");
+        serializer_.dump(result, false, false, 0);
+        buf_.push_back('}');
+        return finish();
+    }
+
+    // Error response. A nullopt id encodes the null id of protocol errors.
+    std::string_view error(std::optional<int> id, int code, std::string_view message, const json& data) {
+        begin();
+        if (encoding_ != Encoding::Json) {
+            details::append_map_head(buf_, encoding_, 3);
+            bin_key("jsonrpc");
+            details::append_string(buf_, encoding_, "2.0");
+            bin_key("id");
+            bin_value(id.has_value() ? json(id.value()) : json(nullptr));
+            bin_key("error");
+            details::append_map_head(buf_, encoding_, 2 + !data.is_null());
+            bin_key("code");
+            bin_value(code);
+            bin_key("message");
+            details::append_string(buf_, encoding_, message);
+            if (!data.is_null()) {
+                bin_key("data");
+                bin_value(data);
+            }
+            return finish();
+        }
+        buf_.append(R"({"jsonrpc":"2.0","id":)");
+        if (id.has_value()) {
+            append_int(id.value());
+        } else {
+            buf_.append("null");
+        }
+        buf_.append(R"(,"error":{"code":)");
+        append_int(code);
+        buf_.append(R"(,"message":)");
+        append_string(message);
+        if (!data.is_null()) {
+            buf_.append(R"(,"data":)");
+            serializer_.dump(data, false, false, 0);
+        }
+        buf_.append("}}");
+        return finish();
+    }
+
+    // Frame an already encoded body, e.g. a batch array, in this encoder's encoding.
+    std::string_view wrap(std::string_view body) {
+        begin();
+        buf_.append(body);
+        return finish();
+    }
+
+    // Body (without header) of the frame returned by the last call.
+    std::string_view body() const {
+        return std::string_view(buf_.data() + kHeaderReserve, buf_.size() - kHeaderReserve);
+    }
+
+private:
+    static constexpr std::string_view kLengthPrefix = "Content-Length: ";
+    static constexpr std::string_view kTypePrefix = "\r\nContent-Type: ";
+    static constexpr std::string_view kHeaderEnd = "\r\n\r\n";
+    // Prefix + up to 20 digits + longest Content-Type line + terminator.
+    static constexpr size_t kHeaderReserve =
+        kLengthPrefix.size() + 20 + kTypePrefix.size() + 32 + kHeaderEnd.size();
+
+    std::string buf_;
+    nlohmann::detail::serializer<json> serializer_;
+    Encoding encoding_ = Encoding::Json;
+
+    void begin() {
+        buf_.clear();
+        buf_.append(kHeaderReserve, ' ');
+    }
+
+    std::string_view finish() {
+        char digits[24];
+        auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), buf_.size() - kHeaderReserve);
+        size_t ndigits = end - digits;
+        std::string_view type = content_type(encoding_);
+        size_t type_size = type.empty() ? 0 : kTypePrefix.size() + type.size();
+        size_t start = kHeaderReserve - (kLengthPrefix.size() + ndigits + type_size + kHeaderEnd.size());
+        char* p = buf_.data() + start;
+        std::memcpy(p, kLengthPrefix.data(), kLengthPrefix.size());
+        p += kLengthPrefix.size();
+        std::memcpy(p, digits, ndigits);
+        p += ndigits;
+        if (!type.empty()) {
+            std::memcpy(p, kTypePrefix.data(), kTypePrefix.size());
+            p += kTypePrefix.size();
+            std::memcpy(p, type.data(), type.size());
+            p += type.size();
+        }
+        std::memcpy(p, kHeaderEnd.data(), kHeaderEnd.size());
+        return std::string_view(buf_.data() + start, buf_.size() - start);
+    }
+
+    void bin_key(std::string_view key) {
+        details::append_string(buf_, encoding_, key);
+    }
+
+    void bin_value(const json& v) {
+        if (encoding_ == Encoding::Cbor) {
+            json::to_cbor(v, nlohmann::detail::output_adapter<char>(buf_));
+        } else {
+            json::to_msgpack(v, nlohmann::detail::output_adapter<char>(buf_));
+        }
+    }
+
+    void append_int(long long v) {
+        char digits[24];
+        auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), v);
+        buf_.append(digits, end);
+    }
+
+    // Same escaping as the json serializer (without ensure_ascii).
+    void append_string(std::string_view str) {
+        static constexpr char kHex[] = "0123456789abcdef";
+        buf_.push_back('"');
+        for (char ch : str) {
+            unsigned char c = (unsigned char)ch;
+            switch (c) {
+            case '"':  buf_.append("\\\""); break;
+            case '\\': buf_.append("\\\\"); break;
+            case '\b': buf_.append("\\b"); break;
+            case '\f': buf_.append("\\f"); break;
+            case '\n': buf_.append("\\n"); break;
+            case '\r': buf_.append("\\r"); break;
+            case '\t': buf_.append("\\t"); break;
+            default:
+                if (c < 0x20) {
+                    const char esc[] = { '\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xF] };
+                    buf_.append(esc, sizeof(esc));
+                } else {
+                    buf_.push_back(ch);
+                }
+            }
+        }
+        buf_.push_back('"');
+    }
+};
+
+// Body of a batch: encoded messages joined into one array.
+// A binary array header depends on the final count, so room for it is
+// reserved and it is back-patched right-aligned, like the frame header.
+class ArrayBody {
+public:
+    explicit ArrayBody(Encoding enc = Encoding::Json) : encoding_(enc) { clear(); }
+
+    void clear() {
+        buf_.assign(kHeadReserve, ' ');
+        count_ = 0;
+    }
+
+    // Append one encoded message, e.g. FrameEncoder::body().
+    void add(std::string_view message) {
+        if (encoding_ == Encoding::Json && count_ > 0) buf_.push_back(',');
+        buf_.append(message);
+        count_++;
+    }
+
+    size_t size() const { return count_; }
+    Encoding encoding() const { return encoding_; }
+
+    // The messages without an enclosing array; a lone message is sent as is.
+    std::string_view items() const {
+        return std::string_view(buf_).substr(kHeadReserve);
+    }
+
+    // The complete array. Call once, after the last add().
+    std::string_view finish() {
+        std::string head;
+        if (encoding_ == Encoding::Json) {
+            head = "[";
+            buf_.push_back(']');
+        } else {
+            details::append_array_head(head, encoding_, count_);
+        }
+        size_t start = kHeadReserve - head.size();
+        std::memcpy(buf_.data() + start, head.data(), head.size());
+        return std::string_view(buf_).substr(start);
+    }
+
+private:
+    static constexpr size_t kHeadReserve = 9; // Largest array header.
+
+    Encoding encoding_;
+    std::string buf_;
+    size_t count_ = 0;
+};
+}  // namespace jsonrpc
+
+// Code for stdio-based JSON-RPC connection handling.
+namespace jsonrpc {
+
+// Bounded lock-free single-producer/single-consumer queue, used to hand
+// incoming messages from the reader thread to the main thread.
+// Each side caches the other side's index and only reloads it when the
+// queue looks full (producer) or empty (consumer).
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : slots_(round_up(capacity)), mask_(slots_.size() - 1) {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer side. Moves from value only on success.
+    bool try_push(T& value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ > mask_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ > mask_) return false; // Full.
+        }
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side.
+    bool try_pop(T& value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head == tail_cache_) return false; // Empty.
+        }
+        value = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate number of queued items; exact from either side's view.
+    size_t size() const {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return slots_.size(); }
+
+private:
+    static size_t round_up(size_t n) {
+        size_t p = 2;
+        while (p < n) p <<= 1;
+        return p;
+    }
+
+    std::vector<T> slots_;
+    const size_t mask_;
+    // Producer and consumer state live on separate cache lines.
+    alignas(64) std::atomic<size_t> tail_{ 0 };
+    size_t head_cache_ = 0;
+    alignas(64) std::atomic<size_t> head_{ 0 };
+    size_t tail_cache_ = 0;
+};
+
+// Fixed set of threads running posted tasks in FIFO order, for handlers
+// that need not run on the main thread. post() blocks while `capacity`
+// tasks are waiting, which pushes back on the reader like a full inbox.
+class WorkerPool {
+public:
+    using Task = std::function<void()>;
+
+    WorkerPool() = default;
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    ~WorkerPool() { stop(); }
+
+    void start(size_t threads, size_t capacity) {
+        if (!threads_.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = false;
+            capacity_ = (std::max)(capacity, size_t(1));
+        }
+        for (size_t i = 0; i < threads; i++) {
+            threads_.emplace_back([this] { run(); });
+        }
+    }
+
+    // Run the tasks already posted, then join the threads.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        not_full_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+        threads_.clear();
+    }
+
+    // Returns false, dropping the task, if the pool is stopped.
+    bool post(Task task) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_full_.wait(lock, [this] { return tasks_.size() < capacity_ || stopping_; });
+            if (stopping_ || threads_.empty()) return false;
+            tasks_.push_back(std::move(task));
+        }
+        cv_.notify_one();
+        return true;
+    }
+
+    bool running() const { return !threads_.empty(); }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable not_full_;
+    std::deque<Task> tasks_;
+    std::vector<std::thread> threads_;
+    size_t capacity_ = 1;
+    bool stopping_ = false;
+
+    void run() {
+        trace::set_thread_name("jsonrpc worker");
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return !tasks_.empty() || stopping_; });
+            if (tasks_.empty()) return; // Stopped and drained.
+            Task task = std::move(tasks_.front());
+            tasks_.pop_front();
+            lock.unlock();
+            not_full_.notify_one();
+            task();
+            lock.lock();
+        }
+    }
+};
+
+// Reads raw bytes from the underlying pipe. Must block until at least one
+// byte is available, and returns the number of bytes read (0 on EOF/error).
+using ByteSource = std::function<size_t(char*, size_t)>;
+
+// Reads directly from the stdin file descriptor/handle. Pipe reads return as
+// soon as any data is available, so a single call may yield many frames.
+inline ByteSource stdin_source() {
+    return [](char* buf, size_t len) -> size_t {
+#ifdef _WIN32
+        int n = _read(_fileno(stdin), buf, (unsigned int)(std::min)(len, (size_t)INT_MAX));
+#else
+        ssize_t n = ::read(STDIN_FILENO, buf, len);
+#endif
+        return n > 0 ? (size_t)n : 0;
+        };
+}
+
+// Reads from an arbitrary std::istream. Blocks for the first byte only, then
+// takes whatever the stream buffer already holds.
+inline ByteSource istream_source(std::istream& in) {
+    return [&in](char* buf, size_t len) -> size_t {
+        std::streambuf* sb = in.rdbuf();
+        if (!sb || len == 0) return 0;
+        auto c = sb->sbumpc();
+        if (c == std::char_traits<char>::eof()) return 0;
+        buf[0] = std::char_traits<char>::to_char_type(c);
+        size_t n = 1;
+        std::streamsize avail = sb->in_avail();
+        if (avail > 0) {
+            n += (size_t)sb->sgetn(buf + 1, (std::streamsize)(std::min)(len - 1, (size_t)avail));
+        }
+        return n;
+        };
+}
+
+// Writes raw bytes to the underlying pipe. Returns false on error.
+using ByteSink = std::function<bool(const char*, size_t)>;
+
+// Writes directly to the stdout file descriptor/handle, bypassing iostreams.
+inline ByteSink stdout_sink() {
+    return [](const char* buf, size_t len) -> bool {
+        while (len > 0) {
+#ifdef _WIN32
+            int n = _write(_fileno(stdout), buf, (unsigned int)(std::min)(len, (size_t)INT_MAX));
+#else
+            ssize_t n = ::write(STDOUT_FILENO, buf, len);
+#endif
+            if (n <= 0) return false;
+            buf += n;
+            len -= (size_t)n;
+        }
+        return true;
+        };
+}
+
+// Writes to an arbitrary std::ostream.
+inline ByteSink ostream_sink(std::ostream& out) {
+    return [&out](const char* buf, size_t len) -> bool {
+        out.write(buf, (std::streamsize)len);
+        out.flush();
+        return out.good();
+        };
+}
+
+// Content-Length framing layer on top of a ByteSource.
+// Reads large chunks into a reusable buffer and locates frames in place, so
+// several frames can be served from a single read. A frame spanning reads is
+// completed by compacting the unread tail to the front of the buffer (growing
+// it only when a frame is larger than the buffer) and reading more.
+// A body larger than the buffer can instead be streamed through
+// body_begin()/body_end() while it arrives, without ever holding it whole.
+class FrameReader {
+public:
+    enum class Status {
+        Ok,             // A frame is available.
+        Eof,            // Clean end of stream between frames.
+        MissingLength,  // Header block without a valid Content-Length.
+        TooLarge,       // Content-Length exceeds the configured limit.
+        HeaderTooLarge, // Header block does not fit the header limit.
+        Incomplete,     // Stream ended in the middle of a frame.
+    };
+
+    static constexpr size_t kDefaultChunkSize = 64 * 1024;
+    static constexpr size_t kMaxHeaderSize = 8 * 1024;
+
+    FrameReader(ByteSource source, size_t max_content_length, size_t chunk_size = kDefaultChunkSize)
+        : source_(std::move(source)), max_content_length_(max_content_length),
+        chunk_size_((std::max)(chunk_size, kMaxHeaderSize)), buffer_(chunk_size_) {}
+
+    // Input iterator over the unread part of the current body. Advancing it
+    // consumes the byte and refills the buffer from the source when it runs
+    // dry. It compares equal to the default (end) iterator once the body is
+    // consumed, or when the stream ends early (body_left() is then nonzero).
+    class BodyIterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = char;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const char*;
+        using reference = const char&;
+
+        BodyIterator() = default;
+        explicit BodyIterator(FrameReader* reader) : reader_(reader) {}
+
+        reference operator*() const { return reader_->buffer_[reader_->begin_]; }
+        BodyIterator& operator++() {
+            if (!reader_->advance()) reader_ = nullptr;
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        bool operator==(const BodyIterator& other) const { return reader_ == other.reader_; }
+
+    private:
+        FrameReader* reader_ = nullptr;
+    };
+
+    // Get the next frame body. The view points into the internal buffer and
+    // stays valid until the next call.
+    Status next(std::string_view& body) {
+        Status st = next_header();
+        if (st != Status::Ok) return st;
+        return read_body(body);
+    }
+
+    // Read the header of the next frame. On Ok the body is pending and must
+    // be taken with read_body() or consumed through body_begin().
+    Status next_header() {
+        size_t body_begin = 0;
+        size_t length = 0;
+        while (true) {
+            Status st = parse_header(body_begin, length);
+            if (st == Status::Ok) break;
+            if (st != Status::Incomplete) return st;
+            if (end_ - begin_ >= kMaxHeaderSize) return Status::HeaderTooLarge;
+            if (!fill(kMaxHeaderSize)) return Status::Eof;
+        }
+        begin_ = body_begin;
+        body_left_ = length;
+        return Status::Ok;
+    }
+
+    // Buffer the whole pending body.
+    Status read_body(std::string_view& body) {
+        size_t length = body_left_;
+        while (end_ - begin_ < length) {
+            if (!fill(length)) {
+                received_ = end_ - begin_;
+                return Status::Incomplete;
+            }
+        }
+        body = std::string_view(buffer_.data() + begin_, length);
+        begin_ += length;
+        body_left_ = 0;
+        return Status::Ok;
+    }
+
+    // Stream the pending body. Only the read buffer is used, however large
+    // the body is.
+    BodyIterator body_begin() {
+        if (body_left_ == 0) return {};
+        if (begin_ == end_ && !fill(1)) return {};
+        return BodyIterator(this);
+    }
+    BodyIterator body_end() { return {}; }
+
+    // Bytes of the pending body not consumed yet.
+    size_t body_left() const { return body_left_; }
+
+    // Discard the rest of the pending body, e.g. after a parse error in a
+    // streamed body. Returns false, with Incomplete diagnostics, if the
+    // stream ended first.
+    bool skip_body() {
+        while (body_left_ > 0) {
+            size_t n = (std::min)(end_ - begin_, body_left_);
+            begin_ += n;
+            body_left_ -= n;
+            if (body_left_ > 0 && !fill(1)) {
+                received_ = content_length_ - body_left_;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Bodies up to this size fit the buffer without growing it.
+    size_t chunk_size() const { return chunk_size_; }
+
+    // Encoding of the last frame, from its Content-Type header.
+    Encoding encoding() const { return encoding_; }
+
+    // Diagnostics for the last frame header seen.
+    size_t content_length() const { return content_length_; }
+    size_t received() const { return received_; }
+
+private:
+    ByteSource source_;
+    size_t max_content_length_;
+    size_t chunk_size_;
+    std::vector<char> buffer_;
+    size_t begin_ = 0; // First unconsumed byte.
+    size_t end_ = 0;   // One past the last valid byte.
+    size_t content_length_ = 0;
+    size_t received_ = 0;
+    size_t body_left_ = 0;
+    Encoding encoding_ = Encoding::Json;
+
+    // Consume one body byte. Returns false at the end of the body, or when
+    // the stream ends before it.
+    bool advance() {
+        ++begin_;
+        if (--body_left_ == 0) return false;
+        if (begin_ == end_ && !fill(1)) {
+            received_ = content_length_ - body_left_;
+            return false;
+        }
+        return true;
+    }
+
+    // Parse "Name: value\r\n" lines up to the empty line.
+    // On success body_begin is the buffer offset of the body.
+    Status parse_header(size_t& body_begin, size_t& length) {
+        const char* base = buffer_.data();
+        size_t pos = begin_;
+        length = 0;
+        encoding_ = Encoding::Json;
+        while (true) {
+            const void* nl = std::memchr(base + pos, '\n', end_ - pos);
+            if (!nl) return Status::Incomplete;
+            size_t line_end = (const char*)nl - base;
+            std::string_view line(base + pos, line_end - pos);
+            pos = line_end + 1;
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            if (line.empty()) break; // End of headers.
+            constexpr std::string_view kName = "Content-Length:";
+            if (line.starts_with(kName)) {
+                line.remove_prefix(kName.size());
+                while (!line.empty() && line.front() == ' ') line.remove_prefix(1);
+                size_t value = 0;
+                auto [p, ec] = std::from_chars(line.data(), line.data() + line.size(), value);
+                length = (ec == std::errc()) ? value : 0;
+            }
+            constexpr std::string_view kType = "Content-Type:";
+            if (line.starts_with(kType)) {
+                encoding_ = encoding_from_content_type(line.substr(kType.size()));
+            }
+        }
+        content_length_ = length;
+        if (length == 0) return Status::MissingLength;
+        if (length > max_content_length_) return Status::TooLarge;
+        body_begin = pos;
+        return Status::Ok;
+    }
+
+    // Make room for at least `need` bytes from begin_ and read once more.
+    bool fill(size_t need) {
+        if (begin_ > 0) {
+            std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        if (buffer_.size() < need) {
+            buffer_.resize(need);
+        } else if (end_ == 0 && need <= chunk_size_ && buffer_.size() > 4 * chunk_size_) {
+            // Give back the memory of an earlier oversized frame.
+            std::vector<char>(chunk_size_).swap(buffer_);
+        }
+        size_t n = source_(buffer_.data() + end_, buffer_.size() - end_);
+        if (n == 0) return false;
+        end_ += n;
+        return true;
+    }
+};
+
+// Collects the replies to one incoming batch. Once every request in the
+// batch has been answered, the replies go out together as one array frame.
+// Replies may arrive from any thread.
+class BatchReply {
+public:
+    explicit BatchReply(size_t expected, Encoding enc = Encoding::Json)
+        : remaining_(expected), body_(enc) {}
+
+    // Replies are encoded like the batch they answer.
+    Encoding encoding() const { return body_.encoding(); }
+
+    // Append one encoded reply. Returns true, with the complete array in
+    // `out`, when this was the last outstanding reply.
+    bool add(std::string_view reply, std::string& out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (remaining_ == 0) return false; // Duplicate reply.
+        body_.add(reply);
+        if (--remaining_ > 0) return false;
+        out = body_.finish();
+        return true;
+    }
+
+private:
+    std::mutex mutex_;
+    size_t remaining_;
+    ArrayBody body_;
+};
+
+// Fixed-bucket latency histogram in microseconds, in the style of
+// HdrHistogram: values below 16us have exact buckets, larger ones get 16
+// buckets per power of two (about 6% precision), up to 2^36us.
+// Recording is a few relaxed atomic operations, so any thread may record;
+// readers get a consistent enough snapshot for monitoring.
+class LatencyHistogram {
+public:
+    void record(std::chrono::steady_clock::duration d) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        uint64_t v = us > 0 ? (uint64_t)us : 0;
+        buckets_[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(v, std::memory_order_relaxed);
+        uint64_t m = max_.load(std::memory_order_relaxed);
+        while (v > m && !max_.compare_exchange_weak(m, v, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    double mean() const {
+        uint64_t n = count();
+        return n ? (double)sum_.load(std::memory_order_relaxed) / n : 0.0;
+    }
+
+    // Smallest recorded bucket covering the fraction q of the samples,
+    // reported as the bucket's upper bound (capped at max()).
+    uint64_t percentile(double q) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = (uint64_t)(q * n + 0.999999);
+        rank = (std::clamp)(rank, uint64_t(1), n);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= rank) return (std::min)(upper_bound_of(i), max());
+        }
+        return max();
+    }
+
+    void reset() {
+        for (auto& b : buckets_) b.store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    // {"count", "mean", "p50", "p99", "p999", "max"}, in microseconds.
+    json summary() const {
+        return json{
+            {"count", count()}, {"mean", mean()},
+            {"p50", percentile(0.5)}, {"p99", percentile(0.99)}, {"p999", percentile(0.999)},
+            {"max", max()},
+        };
+    }
+
+private:
+    static constexpr int kSubBits = 4;
+    static constexpr uint64_t kSub = 1 << kSubBits;
+    static constexpr int kMaxExp = 36;
+    static constexpr size_t kBuckets = (kMaxExp - kSubBits + 1) * kSub + kSub;
+
+    std::atomic<uint64_t> buckets_[kBuckets] = {};
+    std::atomic<uint64_t> count_{ 0 };
+    std::atomic<uint64_t> sum_{ 0 };
+    std::atomic<uint64_t> max_{ 0 };
+
+    static size_t bucket_of(uint64_t v) {
+        if (v < kSub) return (size_t)v;
+        int e = (std::min)((int)std::bit_width(v) - 1, kMaxExp);
+        if (e == kMaxExp && v >> kMaxExp > 1) return kBuckets - 1; // Out of range.
+        uint64_t sub = (v >> (e - kSubBits)) - kSub;
+        return (size_t)((e - kSubBits + 1) * kSub + sub);
+    }
+
+    static uint64_t upper_bound_of(size_t i) {
+        if (i < kSub) return i;
+        int e = (int)(i / kSub) + kSubBits - 1;
+        uint64_t sub = i % kSub;
+        return ((kSub + sub + 1) << (e - kSubBits)) - 1;
+    }
+};
+
+class Conn; // Forward declaration.
+
+namespace details {
+
+// State of an incoming request shared by all copies of its Context.
+struct RequestState {
+    std::mutex mutex;
+    bool replied = false;
+    bool cancelled = false;
+    bool tracked = false; // In the connection's in-flight table.
+    // Method whose reply latency the request counts in, measured from dispatch.
+    uint32_t method = UINT32_MAX;
+    std::chrono::steady_clock::time_point dispatched;
+    std::vector<std::function<void()>> on_cancel;
+    // Set for a call made by Conn::invoke(): the reply goes here instead
+    // of to the peer.
+    std::function<void(const Response&)> local_reply;
+};
+
+} // namespace details
+
+// Cancellation state of an incoming request, see Context::cancellation().
+// Poll cancelled(), or subscribe with on_cancel(). Cancellation happens on
+// the thread that calls process_queue(), where $/cancelRequest is handled,
+// so callbacks run there too.
+class CancellationToken {
+public:
+    CancellationToken() = default; // Never cancelled.
+
+    bool cancelled() const {
+        if (!state_) return false;
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->cancelled;
+    }
+
+    // Run cb when the request is cancelled, or right away if it already is.
+    // Dropped without a call once the request has been answered.
+    void on_cancel(std::function<void()> cb) const {
+        if (!state_) return;
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            if (state_->replied) return;
+            if (!state_->cancelled) {
+                state_->on_cancel.push_back(std::move(cb));
+                return;
+            }
+        }
+        cb();
+    }
+
+private:
+    friend class Context;
+    explicit CancellationToken(std::shared_ptr<details::RequestState> state) : state_(std::move(state)) {}
+
+    std::shared_ptr<details::RequestState> state_;
+};
+
+// Context passed to async request handlers.
+// Allows handlers to reply or send errors asynchronously.
+// Once the peer cancels the request, reply() and error() send nothing;
+// inside a batch a RequestCancelled error takes the reply's place.
+class Context {
+public:
+    Context(Conn& c, std::optional<int> i, std::shared_ptr<BatchReply> batch = nullptr,
+            Encoding enc = Encoding::Json, std::shared_ptr<details::RequestState> state = nullptr)
+        : conn_(c), id_(i), batch_(std::move(batch)), encoding_(enc), state_(std::move(state)) {}
+
+    void reply(json result);
+    void error(int code, std::string message, json data = nullptr);
+
+    // Whether the peer cancelled this request with $/cancelRequest.
+    bool cancelled() const { return cancellation().cancelled(); }
+    CancellationToken cancellation() const { return CancellationToken(state_); }
+
+    // Streamed results. A large result is sent as a sequence of
+    // $/streamChunk notifications {"id": <request id>, "seq": n, "data": chunk}
+    // and finished with end_stream(), which replies {"stream": <request id>,
+    // "chunks": n}. Every chunk is its own frame, so no single message has
+    // to hold the whole result. The chunk counter lives in this object.
+    static constexpr size_t kStreamChunkSize = 64 * 1024;
+    void stream(json chunk);
+    // Stream text in slices of at most chunk_size bytes, cut on UTF-8
+    // character boundaries.
+    void stream_text(std::string_view text, size_t chunk_size = kStreamChunkSize);
+    void end_stream();
+
+    // Binary result: through the shared blob region when the peer opened one
+    // and the data is large enough to be worth it, inline as base64
+    // otherwise. See blob.hpp for the reply shapes.
+    static constexpr size_t kBlobThreshold = 16 * 1024;
+    void reply_bytes(std::string_view data);
+
+    std::optional<int> id() const { return id_; }
+    bool is_notification() const { return !id_.has_value(); }
+    // Encoding of the request frame, which the reply uses as well.
+    Encoding encoding() const { return encoding_; }
+
+private:
+    Conn& conn_;
+    std::optional<int> id_;
+    // Set when the request arrived in a batch; the reply joins the batch reply.
+    std::shared_ptr<BatchReply> batch_;
+    Encoding encoding_;
+    std::shared_ptr<details::RequestState> state_;
+    int stream_seq_ = 0;
+
+    // Mark the request answered. Returns false if it already was, or if it
+    // was cancelled.
+    bool settle();
+    // Deliver a result to the peer, or to the caller of a local call.
+    void send_result(json result);
+};
+
+namespace details {
+
+// Coroutine frames of Task handlers, recycled by size class so a request
+// served by a coroutine costs no heap allocation once warm. Frames above
+// kMaxPooled, or beyond kCached per class, go straight to the heap.
+class FramePool {
+public:
+    static constexpr size_t kHeader = 16;    // Size class, keeps 16-byte alignment.
+    static constexpr size_t kGranule = 128;
+    static constexpr size_t kMaxPooled = 4 * 1024;
+    static constexpr size_t kCached = 64;
+
+    static void* allocate(size_t bytes) {
+        size_t cls = (kHeader + bytes + kGranule - 1) / kGranule;
+        char* block = nullptr;
+        if (cls * kGranule <= kMaxPooled) {
+            std::lock_guard<std::mutex> lock(mutex());
+            auto& list = lists()[cls];
+            if (!list.empty()) {
+                block = list.back();
+                list.pop_back();
+            }
+        } else {
+            cls = 0;
+        }
+        if (!block) block = static_cast<char*>(::operator new(cls ? cls * kGranule : kHeader + bytes));
+        *reinterpret_cast<size_t*>(block) = cls;
+        return block + kHeader;
+    }
+
+    static void deallocate(void* p) noexcept {
+        char* block = static_cast<char*>(p) - kHeader;
+        size_t cls = *reinterpret_cast<size_t*>(block);
+        if (cls) {
+            std::lock_guard<std::mutex> lock(mutex());
+            auto& list = lists()[cls];
+            if (list.size() < kCached) {
+                list.push_back(block);
+                return;
+            }
+        }
+        ::operator delete(block);
+    }
+
+private:
+    using Lists = std::array<std::vector<char*>, kMaxPooled / kGranule + 1>;
+
+    // Never destroyed, like the arena cache.
+    static std::mutex& mutex() {
+        static auto* m = new std::mutex;
+        return *m;
+    }
+    static Lists& lists() {
+        static auto* l = new Lists;
+        return *l;
+    }
+};
+
+} // namespace details
+
+// Return type of coroutine handlers, see Conn::register_async_method():
+//
+//     Task handle_open(Context ctx, const json& params) {
+//         auto path = params.at(0).get<std::string>();
+//         auto file = co_await open_async(path);
+//         ctx.reply(co_await file.read_async());
+//     }
+//
+// The coroutine starts at once and frees itself when it ends; nothing
+// waits on a Task. An exception escaping it is answered through the
+// coroutine's Context parameter as a sync handler's would be. As with any
+// async handler, params is only valid until the first suspension.
+class Task {
+public:
+    struct promise_type {
+        std::optional<Context> ctx;
+
+        promise_type() = default;
+        // Sees the coroutine's arguments (and the object, for a lambda or
+        // member) and keeps the first Context among them.
+        template <typename... Args>
+        explicit promise_type(Args&... args) { (keep(args), ...); }
+
+        Task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+
+        void unhandled_exception() noexcept {
+            if (!ctx) return;
+            try {
+                throw;
+            } catch (const JsonRpcException& e) {
+                ctx->error(e.code, e.what(), e.data);
+            } catch (const std::exception& e) {
+                ctx->error(spec::kInternalError, e.what());
+            } catch (...) {
+                ctx->error(spec::kInternalError, "Unknown exception");
+            }
+        }
+
+        static void* operator new(size_t n) { return details::FramePool::allocate(n); }
+        static void operator delete(void* p) noexcept { details::FramePool::deallocate(p); }
+
+    private:
+        void keep(Context& c) {
+            if (!ctx) ctx.emplace(c);
+        }
+        template <typename T>
+        void keep(T&) {}
+    };
+};
+
+// Awaits a Response handed to a callback: start(callback) makes the call,
+// see Conn::request() and Conn::invoke(). The callback may run before
+// start returns, then the coroutine goes on without suspending.
+template <typename Start>
+class ResponseAwaiter {
+public:
+    explicit ResponseAwaiter(Start start) : start_(std::move(start)) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        handle_ = h;
+        start_([this](const Response& r) {
+            response_ = r;
+            if (state_.exchange(kDone, std::memory_order_acq_rel) == kSuspended) handle_.resume();
+            });
+        int starting = kStarting;
+        return state_.compare_exchange_strong(starting, kSuspended, std::memory_order_acq_rel);
+    }
+    Response await_resume() { return std::move(response_); }
+
+private:
+    static constexpr int kStarting = 0, kSuspended = 1, kDone = 2;
+
+    Start start_;
+    std::coroutine_handle<> handle_;
+    std::atomic<int> state_{ kStarting };
+    Response response_;
+};
+
+namespace details {
+
+// Hierarchical timer wheel over timers numbered 0..n-1, for the deadlines
+// of outgoing requests. Four levels of 64 buckets at kTick cover about 46
+// hours; later deadlines fire at that horizon. Buckets are intrusive
+// lists, so scheduling, cancelling and expiring a timer cost O(1). A timer
+// moves down a level when its bucket comes up, once every 64 ticks of the
+// level below.
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr auto kTick = std::chrono::milliseconds(10);
+    static constexpr int kBits = 6;
+    static constexpr uint64_t kBuckets = uint64_t(1) << kBits;
+    static constexpr int kLevels = 4;
+
+    explicit TimerWheel(Clock::time_point origin = Clock::now()) : origin_(origin) {
+        heads_.fill(kNone);
+    }
+
+    // Schedule (or move) a timer.
+    void schedule(uint32_t timer, Clock::time_point deadline) {
+        if (timer >= nodes_.size()) nodes_.resize(timer + 1);
+        cancel(timer);
+        uint64_t max = (uint64_t(1) << (kBits * kLevels)) - 1;
+        // Round up: a timer never fires before its deadline.
+        uint64_t expiry = (std::max)(tick_of(deadline) + 1, now_ + 1);
+        nodes_[timer].expiry = (std::min)(expiry, now_ + max);
+        link(timer);
+        count_++;
+    }
+
+    void cancel(uint32_t timer) {
+        if (timer >= nodes_.size() || nodes_[timer].bucket == kNone) return;
+        unlink(timer);
+        count_--;
+    }
+
+    // Step to `now`, calling expired(timer) for each timer due by then.
+    // Timers may be scheduled or cancelled from the callback.
+    template <typename F>
+    void advance(Clock::time_point now, F&& expired) {
+        uint64_t target = tick_of(now);
+        while (now_ < target) {
+            if (count_ == 0) {
+                now_ = target;
+                return;
+            }
+            now_++;
+            // Bring down the buckets of the levels whose period starts now.
+            for (int level = 1; level < kLevels; level++) {
+                if (now_ & ((uint64_t(1) << (kBits * level)) - 1)) break;
+                int32_t t = take_bucket(level, (now_ >> (kBits * level)) & (kBuckets - 1));
+                while (t != kNone) {
+                    int32_t next = nodes_[t].next;
+                    link(t);
+                    t = next;
+                }
+            }
+            int32_t t = take_bucket(0, now_ & (kBuckets - 1));
+            while (t != kNone) {
+                int32_t next = nodes_[t].next;
+                nodes_[t].bucket = kNone;
+                count_--;
+                expired((uint32_t)t);
+                t = next;
+            }
+        }
+    }
+
+    // Earliest time advance() can have work, nullopt without timers. It
+    // may be a cascade that expires nothing; ask again after it.
+    std::optional<Clock::time_point> next_expiry() const {
+        if (count_ == 0) return std::nullopt;
+        for (uint64_t t = now_ + 1; t <= now_ + kBuckets; t++) {
+            if (t % kBuckets == 0) return time_of(t);
+            if (heads_[t % kBuckets] != kNone) return time_of(t);
+        }
+        return time_of(now_ + 1);
+    }
+
+    size_t size() const { return count_; }
+
+private:
+    static constexpr int32_t kNone = -1;
+
+    struct Node {
+        uint64_t expiry = 0;
+        int32_t prev = kNone;
+        int32_t next = kNone;
+        int32_t bucket = kNone;
+    };
+
+    Clock::time_point origin_;
+    uint64_t now_ = 0; // Last tick processed.
+    size_t count_ = 0;
+    std::vector<Node> nodes_;
+    std::array<int32_t, kBuckets * kLevels> heads_;
+
+    uint64_t tick_of(Clock::time_point t) const {
+        if (t <= origin_) return 0;
+        return (uint64_t)((t - origin_) / kTick);
+    }
+    Clock::time_point time_of(uint64_t tick) const { return origin_ + tick * kTick; }
+
+    // Put a timer in the bucket for its expiry, seen from now_.
+    void link(int32_t t) {
+        Node& n = nodes_[t];
+        uint64_t delta = n.expiry > now_ ? n.expiry - now_ : 0;
+        int level = 0;
+        while (level + 1 < kLevels && delta >= (uint64_t(1) << (kBits * (level + 1)))) level++;
+        n.bucket = (int32_t)(level * kBuckets + ((n.expiry >> (kBits * level)) & (kBuckets - 1)));
+        n.prev = kNone;
+        n.next = heads_[n.bucket];
+        if (n.next != kNone) nodes_[n.next].prev = t;
+        heads_[n.bucket] = t;
+    }
+
+    void unlink(int32_t t) {
+        Node& n = nodes_[t];
+        if (n.prev != kNone) {
+            nodes_[n.prev].next = n.next;
+        } else {
+            heads_[n.bucket] = n.next;
+        }
+        if (n.next != kNone) nodes_[n.next].prev = n.prev;
+        n.bucket = kNone;
+    }
+
+    int32_t take_bucket(int level, uint64_t index) {
+        int32_t& head = heads_[level * kBuckets + index];
+        int32_t t = head;
+        head = kNone;
+        return t;
+    }
+};
+
+// Requests sent to the peer and not answered yet: a flat table of slots
+// with the id naming its slot, and the deadlines in a TimerWheel. The id
+// also carries the slot's generation, so a late reply to an expired
+// request does not reach the request that reuses its slot.
+class PendingRequests {
+public:
+    using Callback = std::function<void(const Response&)>;
+    using Clock = std::chrono::steady_clock;
+    static constexpr int kSlotBits = 16;
+    static constexpr size_t kMaxSlots = size_t(1) << kSlotBits;
+
+    // The id of the new request, which takes over callback. 0 if kMaxSlots
+    // are in flight, leaving callback alone.
+    int add(Callback& callback, Clock::time_point deadline) {
+        uint32_t index;
+        if (!free_.empty()) {
+            index = free_.back();
+            free_.pop_back();
+        } else if (slots_.size() < kMaxSlots) {
+            index = (uint32_t)slots_.size();
+            slots_.emplace_back();
+        } else {
+            return 0;
+        }
+        Slot& s = slots_[index];
+        // Generations run 1..32767, keeping ids positive and non-zero.
+        s.generation = s.generation % 32767 + 1;
+        s.callback = std::move(callback);
+        s.busy = true;
+        wheel_.schedule(index, deadline);
+        return (int)((uint32_t)s.generation << kSlotBits | index);
+    }
+
+    // Remove a request, returning its callback; nullptr for an unknown id.
+    Callback take(int id) {
+        uint32_t index = (uint32_t)id & (kMaxSlots - 1);
+        if (id <= 0 || index >= slots_.size()) return nullptr;
+        Slot& s = slots_[index];
+        if (!s.busy || s.generation != ((uint32_t)id >> kSlotBits)) return nullptr;
+        wheel_.cancel(index);
+        return release(index);
+    }
+
+    // Remove the requests due by `now`, appending them to `out`.
+    void expire(Clock::time_point now, std::vector<std::pair<int, Callback>>& out) {
+        wheel_.advance(now, [&](uint32_t index) {
+            int id = (int)((uint32_t)slots_[index].generation << kSlotBits | index);
+            out.emplace_back(id, release(index));
+        });
+    }
+
+    // Remove every request, appending them to `out`.
+    void take_all(std::vector<std::pair<int, Callback>>& out) {
+        for (uint32_t i = 0; i < slots_.size(); i++) {
+            if (!slots_[i].busy) continue;
+            wheel_.cancel(i);
+            int id = (int)((uint32_t)slots_[i].generation << kSlotBits | i);
+            out.emplace_back(id, release(i));
+        }
+    }
+
+    std::optional<Clock::time_point> next_deadline() const { return wheel_.next_expiry(); }
+    size_t size() const { return wheel_.size(); }
+
+private:
+    struct Slot {
+        Callback callback;
+        uint16_t generation = 0;
+        bool busy = false;
+    };
+
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> free_;
+    TimerWheel wheel_;
+
+    Callback release(uint32_t index) {
+        Slot& s = slots_[index];
+        s.busy = false;
+        free_.push_back(index);
+        Callback callback = std::move(s.callback);
+        s.callback = nullptr;
+        return callback;
+    }
+};
+
+} // namespace details
+
+// Priority lanes of the incoming queue. process_queue() serves every
+// interactive message before any bulk one, so order is kept within a lane
+// but not across lanes, even for the same webview: a client that needs a
+// bulk request to run first must wait for its reply.
+enum class Lane : uint8_t {
+    Interactive, // Input, focus and layout traffic; also all responses.
+    Bulk,        // Slow or heavy requests that can wait a frame.
+};
+constexpr size_t kLaneCount = 2;
+
+// Thread a handler runs on.
+enum class Affinity : uint8_t {
+    MainThread, // Dispatched by process_queue(), e.g. anything touching COM.
+    AnyThread,  // Pure computation; runs on the connection's worker pool.
+};
+
+// Latest-wins merging of queued notifications, for idempotent ones like
+// "resize webview N". When a notification is dispatched while a newer one
+// with the same key is already queued, it is skipped: dropped, or folded
+// into the newer one if fold is set. Requests are never merged, and only
+// notifications queued with no other method between them merge.
+struct MergePolicy {
+    // Key of a notification, or nullopt to never merge it. Runs on the
+    // reader thread, so it must only look at params.
+    std::function<std::optional<int64_t>(const json& params)> key;
+    // Optional. Merge the params of an older notification into those of a
+    // newer one, in place; fields set in `newer` win. Must not throw.
+    std::function<void(json& newer, const json& older)> fold;
+
+    explicit operator bool() const { return (bool)key; }
+};
+
+// Per-method options given at registration.
+struct MethodOptions {
+    Lane lane = Lane::Interactive; // Ignored for AnyThread methods.
+    Affinity affinity = Affinity::MainThread;
+    MergePolicy merge;             // Main-thread notifications only; AnyThread throws.
+};
+
+// Limits for one process_queue() call. When either is reached with work
+// left, the call returns and the waker is fired again.
+struct DispatchBudget {
+    size_t max_messages = SIZE_MAX;
+    std::chrono::steady_clock::duration max_time = std::chrono::steady_clock::duration::max();
+};
+
+// Queueing latency of one lane, from reader-thread parse to dispatch.
+struct LaneStats {
+    uint64_t count = 0;
+    std::chrono::microseconds total{ 0 };
+    std::chrono::microseconds max{ 0 };
+    size_t queued = 0; // Messages currently waiting in the lane.
+
+    std::chrono::microseconds mean() const {
+        return count ? total / (int64_t)count : std::chrono::microseconds(0);
+    }
+};
+
+// Typed positional params, see Conn::register_method<Args...>().
+// ParamTraits<T>::decode checks the type of one param and converts it in
+// place, without an intermediate json or container; describe() names the
+// expected type in the InvalidParams message. Specialize it for other
+// argument types, as webview.cpp does for RECT and HWND.
+template <typename T, typename = void>
+struct ParamTraits;
+
+template <>
+struct ParamTraits<bool> {
+    static bool decode(const json& j, bool& out) {
+        if (!j.is_boolean()) return false;
+        out = j.get<bool>();
+        return true;
+    }
+    static std::string describe() { return "boolean"; }
+};
+
+// Rejects integers out of T's range instead of truncating them.
+template <typename T>
+struct ParamTraits<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>> {
+    static bool decode(const json& j, T& out) {
+        if (j.is_number_unsigned()) {
+            auto v = j.get<json::number_unsigned_t>();
+            if (!std::in_range<T>(v)) return false;
+            out = (T)v;
+            return true;
+        }
+        if (j.is_number_integer()) {
+            auto v = j.get<json::number_integer_t>();
+            if (!std::in_range<T>(v)) return false;
+            out = (T)v;
+            return true;
+        }
+        return false;
+    }
+    static std::string describe() { return "integer"; }
+};
+
+template <typename T>
+struct ParamTraits<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+    static bool decode(const json& j, T& out) {
+        if (!j.is_number()) return false;
+        out = j.get<T>();
+        return true;
+    }
+    static std::string describe() { return "number"; }
+};
+
+template <>
+struct ParamTraits<std::string> {
+    static bool decode(const json& j, std::string& out) {
+        if (!j.is_string()) return false;
+        out = j.get_ref<const std::string&>();
+        return true;
+    }
+    static std::string describe() { return "string"; }
+};
+
+// Points into params, so it is only valid while the handler runs.
+template <>
+struct ParamTraits<std::string_view> {
+    static bool decode(const json& j, std::string_view& out) {
+        if (!j.is_string()) return false;
+        out = j.get_ref<const std::string&>();
+        return true;
+    }
+    static std::string describe() { return "string"; }
+};
+
+// Exactly N elements.
+template <typename T, size_t N>
+struct ParamTraits<std::array<T, N>> {
+    static bool decode(const json& j, std::array<T, N>& out) {
+        if (!j.is_array() || j.size() != N) return false;
+        for (size_t i = 0; i < N; i++) {
+            if (!ParamTraits<T>::decode(j[i], out[i])) return false;
+        }
+        return true;
+    }
+    static std::string describe() { return ParamTraits<T>::describe() + "[" + std::to_string(N) + "]"; }
+};
+
+template <typename T>
+struct ParamTraits<std::vector<T>> {
+    static bool decode(const json& j, std::vector<T>& out) {
+        if (!j.is_array()) return false;
+        out.resize(j.size());
+        for (size_t i = 0; i < j.size(); i++) {
+            if (!ParamTraits<T>::decode(j[i], out[i])) return false;
+        }
+        return true;
+    }
+    static std::string describe() { return ParamTraits<T>::describe() + "[]"; }
+};
+
+// null, or left out when it is among the last params.
+template <typename T>
+struct ParamTraits<std::optional<T>> {
+    static bool decode(const json& j, std::optional<T>& out) {
+        if (j.is_null()) {
+            out.reset();
+            return true;
+        }
+        return ParamTraits<T>::decode(j, out.emplace());
+    }
+    static std::string describe() { return ParamTraits<T>::describe() + " or null"; }
+};
+
+// Any value, copied.
+template <>
+struct ParamTraits<json> {
+    static bool decode(const json& j, json& out) {
+        out = j;
+        return true;
+    }
+    static std::string describe() { return "any value"; }
+};
+
+namespace details {
+
+template <typename T>
+constexpr bool is_optional_v = false;
+template <typename T>
+constexpr bool is_optional_v<std::optional<T>> = true;
+
+template <typename T>
+void decode_param(const json& params, size_t given, size_t i, T& out) {
+    if (i >= given) return; // A trailing optional left out.
+    if (!ParamTraits<T>::decode(params[i], out)) {
+        throw JsonRpcException(spec::kInvalidParams,
+            "params[" + std::to_string(i) + "] must be " + ParamTraits<T>::describe());
+    }
+}
+
+// Decode a params array into Args, or throw InvalidParams. Trailing
+// optional arguments may be left out; null params stand for [] then.
+template <typename... Args>
+std::tuple<Args...> decode_params(const json& params) {
+    constexpr size_t n = sizeof...(Args);
+    constexpr size_t required = [] {
+        bool optional[] = { is_optional_v<Args>..., false };
+        size_t r = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (!optional[i]) r = i + 1;
+        }
+        return r;
+    }();
+    size_t given = params.is_array() ? params.size() : 0;
+    if (!(params.is_array() || (params.is_null() && required == 0)) || given < required || given > n) {
+        throw JsonRpcException(spec::kInvalidParams, required == n
+            ? "expected an array of " + std::to_string(n) + (n == 1 ? " param" : " params")
+            : "expected an array of " + std::to_string(required) + " to " + std::to_string(n) + " params");
+    }
+    std::tuple<Args...> args;
+    [&]<size_t... I>(std::index_sequence<I...>) {
+        (decode_param(params, given, I, std::get<I>(args)), ...);
+    }(std::index_sequence_for<Args...>{});
+    return args;
+}
+
+} // namespace details
+
+// The main connection class that manages the JSON-RPC communication.
+// Implements the "LSP-style" Content-Length framing over Stdin/Stdout.
+// Typically used to integrate with Emacs's jsonrpc.el.
+class Conn {
+public:
+    using AsyncRequestHandler = std::function<void(Context, const json&)>;
+    using RequestHandler      = std::function<json(const json&)>;
+    using ResponseHandler     = std::function<void(const Response&)>;
+    using NotificationHandler = std::function<void(const json&)>;
+    using RawHandler          = std::function<bool(const IncomingMessage&, Conn&)>;
+    using Waker               = std::function<void()>;
+
+    // Index of a method in the table frozen by start().
+    using MethodId = uint32_t;
+    static constexpr MethodId kNoMethod = UINT32_MAX;
+
+    // Default capacity of the incoming message queue. The reader thread
+    // stops reading from the pipe while it is full.
+    static constexpr size_t kInboxCapacity = 4096;
+
+    // Default number of worker threads for AnyThread methods.
+    static constexpr size_t kDefaultWorkers = 2;
+
+    // Default Max Package Size: 16MB. Streaming bounds the read buffer, not
+    // the decoded json, so pass a larger max_pkg_size only where needed.
+    static constexpr size_t kDefaultMaxContentLength = 16 * 1024 * 1024;
+
+    // Snapshot of the outbound queue, see outbox_stats().
+    struct OutboxStats {
+        size_t queued_frames = 0;   // Frames not yet written to the pipe.
+        size_t queued_bytes = 0;    // Bytes not yet written to the pipe.
+        uint64_t frames_written = 0;
+        uint64_t writes = 0;        // Number of gathered writes.
+        uint64_t coalesced = 0;     // Notifications sent through coalescing.
+        uint64_t suppressed = 0;    // Of those, replaced by a newer one unsent.
+    };
+
+    // Constructor: waker is called whenever a new message arrives in the queue.
+    // Use it to wake up your main event loop.
+    Conn(Waker waker,
+        std::istream& input = std::cin,
+        std::ostream& output = std::cout,
+        std::ostream& error = std::cerr,
+        size_t max_pkg_size = kDefaultMaxContentLength)
+        : Conn(std::move(waker),
+            &input == &std::cin ? stdin_source() : istream_source(input),
+            &output == &std::cout ? stdout_sink() : ostream_sink(output),
+            error, max_pkg_size) {
+        // Force Windows stdin/stdout into binary mode to prevent \r\n translation.
+        // Critical for correct Content-Length calculation.
+#ifdef _WIN32
+        if (&input == &std::cin) {
+            (void)_setmode(_fileno(stdin), _O_BINARY);
+        }
+        if (&output == &std::cout) {
+            (void)_setmode(_fileno(stdout), _O_BINARY);
+        }
+        if (&error == &std::cerr) {
+            (void)_setmode(_fileno(stderr), _O_BINARY);
+        }
+#endif
+    }
+
+    // Constructor over raw byte streams, e.g. a socket (see listener.hpp).
+    Conn(Waker waker, ByteSource source, ByteSink sink,
+        std::ostream& error = std::cerr,
+        size_t max_pkg_size = kDefaultMaxContentLength)
+        : running_(false), waker_(std::move(waker)), max_content_length_(max_pkg_size),
+        reader_(std::move(source), max_pkg_size), sink_(std::move(sink)), err_(error) {
+        // {"encoding": "json" | "cbor" | "msgpack"}. The reply still goes
+        // out in the encoding of the request.
+        register_method("$/setEncoding", [this](const json& params) -> json {
+            const json* name = params.is_object() && params.contains("encoding") ? &params["encoding"] : nullptr;
+            auto enc = name && name->is_string() ? encoding_from_name(name->get<std::string>()) : std::nullopt;
+            if (!enc) {
+                throw JsonRpcException(spec::kInvalidParams, "encoding must be \"json\", \"cbor\" or \"msgpack\"");
+            }
+            set_encoding(*enc);
+            return true;
+        });
+        // {"size": bytes}: create and map a temp file as the region for
+        // Context::reply_bytes(), replacing the previous one. Replies with
+        // {"path": file, "size": capacity}; the peer only reads the file.
+        register_method("$/blob/open", [this](const json& params) -> json {
+            const json* size = params.is_object() && params.contains("size") ? &params["size"] : nullptr;
+            if (!size || !size->is_number_unsigned() || size->get<uint64_t>() > blob::Region::kMaxCapacity) {
+                throw JsonRpcException(spec::kInvalidParams, "expected {\"size\": bytes}, at most 1 GiB");
+            }
+            if (!blobs_.open(size->get<uint64_t>())) {
+                throw JsonRpcException(spec::kInternalError, "Cannot create the blob file");
+            }
+            return { {"path", blobs_.path()}, {"size", blobs_.stats().capacity} };
+        });
+        // {"handles": [h, ...]}: blobs the peer has read.
+        register_notification("$/blob/release", [this](const json& params) {
+            if (!params.is_object() || !params.contains("handles") || !params["handles"].is_array()) return;
+            for (const auto& h : params["handles"]) {
+                if (h.is_number_unsigned()) blobs_.release(h.get<uint32_t>());
+            }
+        });
+        // {"id": <request id>}, as sent by jsonrpc.el when a request is abandoned.
+        register_notification("$/cancelRequest", [this](const json& params) {
+            if (params.is_object() && params.contains("id") && params["id"].is_number_integer()) {
+                cancel_request(params["id"].get<int>());
+            }
+        });
+    }
+
+    // Requests still unanswered are cancelled, so Contexts that outlive the
+    // connection turn into no-ops instead of touching it.
+    ~Conn() {
+        stop();
+        abandon_requests();
+        // Requests to the peer will never be answered now.
+        expire_requests(true);
+    }
+
+    // Check whether the Connection is running or not.
+    bool is_running() const {
+        return running_;
+    }
+
+    // Start the background reader thread.
+    void start() {
+        if (running_) return;
+        freeze_methods();
+        running_ = true;
+        // A raw handler sees every message on the main thread, so with one
+        // set AnyThread methods stay there too.
+        bool any_thread = std::any_of(methods_.begin(), methods_.end(),
+            [](const MethodEntry& e) { return e.options.affinity == Affinity::AnyThread; });
+        if (any_thread && !raw_handler_ && worker_count_ > 0) {
+            workers_.start(worker_count_, kInboxCapacity);
+        }
+        // Start the writer thread that drains the outbox to stdout.
+        {
+            std::lock_guard<std::mutex> lock(out_mutex_);
+            writer_stop_ = false;
+        }
+        writer_thread_ = std::thread([this]() { write_loop(); });
+        // Start the reader thread that continuously reads from stdin
+        // and pushes messages to the inbox queue.
+        reader_thread_ = std::thread([this]() { read_loop(); });
+    }
+
+    // Stop the reader thread, flush pending output and cleanup.
+    void stop() {
+        running_ = false;
+        if (reader_thread_.joinable()) {
+            reader_thread_.join();
+        }
+        // Let queued AnyThread requests finish so their replies get out.
+        workers_.stop();
+        {
+            std::lock_guard<std::mutex> lock(out_mutex_);
+            writer_stop_ = true;
+        }
+        out_cv_.notify_one();
+        if (writer_thread_.joinable()) {
+            writer_thread_.join();
+        }
+    }
+
+    // Look up the interned id of a registered method. Valid after start().
+    MethodId method_id(std::string_view name) const {
+        auto it = std::lower_bound(methods_.begin(), methods_.end(), name,
+            [](const MethodEntry& e, std::string_view n) { return e.name < n; });
+        if (it == methods_.end() || it->name != name) return kNoMethod;
+        return (MethodId)(it - methods_.begin());
+    }
+
+    // Current depth of the outbound queue. Safe to call from any thread.
+    OutboxStats outbox_stats() const {
+        return OutboxStats{
+            out_queued_frames_.load(std::memory_order_relaxed),
+            out_queued_bytes_.load(std::memory_order_relaxed),
+            out_frames_written_.load(std::memory_order_relaxed),
+            out_writes_.load(std::memory_order_relaxed),
+            out_coalesced_.load(std::memory_order_relaxed),
+            out_suppressed_.load(std::memory_order_relaxed),
+        };
+    }
+
+    // Cancel an incoming request: its Context reports cancelled(), its
+    // on_cancel callbacks run and its reply is suppressed. A request still
+    // in the queue is answered with kRequestCancelled instead of being
+    // dispatched. Call from the main thread.
+    void cancel_request(int id) {
+        std::shared_ptr<details::RequestState> state;
+        {
+            std::lock_guard<std::mutex> lock(in_flight_mutex_);
+            // The entry stays until the request settles, so abandon_requests()
+            // still sees it if the connection goes first.
+            auto it = in_flight_.find(id);
+            if (it != in_flight_.end()) {
+                state = it->second.lock();
+                if (!state) in_flight_.erase(it);
+            }
+            if (!state) {
+                // Still queued, else already answered or never seen.
+                auto queued = queued_requests_.find(id);
+                if (queued != queued_requests_.end()) queued->second = true;
+                return;
+            }
+        }
+        cancel_state(*state);
+    }
+
+    // Log every incoming frame body and every write to the peer to path,
+    // see record.hpp. While recording, bodies larger than the read buffer
+    // are read whole rather than parsed as they arrive. Any thread.
+    bool start_recording(const std::string& path) {
+        return recorder_.open(path);
+    }
+    // Returns false if the log could not be written completely.
+    bool stop_recording() {
+        return recorder_.close();
+    }
+    bool is_recording() const {
+        return recorder_.is_open();
+    }
+
+    // Encoding of the messages we originate. Replies always use the encoding
+    // of the request they answer. The peer can switch it with $/setEncoding.
+    void set_encoding(Encoding enc) {
+        encoding_.store(enc, std::memory_order_relaxed);
+    }
+    Encoding encoding() const {
+        return encoding_.load(std::memory_order_relaxed);
+    }
+
+    // Number of threads running AnyThread methods, 0 to run them on the
+    // main thread like the rest. Set before start().
+    void set_worker_count(size_t n) {
+        if (running_) {
+            throw std::runtime_error("JSON-RPC Error: Cannot change workers after server start");
+        }
+        worker_count_ = n;
+    }
+
+    // Set a raw handler to intercept all incoming messages (advanced usage).
+    // If the handler returns true, the message is considered handled and won't
+    // be processed further.
+    void set_raw_handler(RawHandler handler) {
+        if (running_) {
+            throw std::runtime_error("JSON-RPC Error: Cannot register methods after server start");
+        }
+        raw_handler_ = std::move(handler);
+    }
+
+    // Register an async method.
+    void register_async_method(const std::string& name, AsyncRequestHandler handler, MethodOptions options = {}) {
+        if (running_) {
+            throw std::runtime_error("JSON-RPC Error: Cannot register methods after server start");
+        }
+        // Worker-pool methods bypass the inbox, where merging happens.
+        if (options.merge && options.affinity == Affinity::AnyThread) {
+            throw std::runtime_error("JSON-RPC Error: A merge policy needs the main thread: " + name);
+        }
+        method_handlers_[name] = MethodEntry{ name, std::move(handler), options };
+    }
+
+    // Register a coroutine method: a handler returning Task, which can
+    // co_await between steps and replies through its Context.
+    template <typename F>
+        requires std::is_same_v<std::invoke_result_t<F&, Context, const json&>, Task>
+    void register_async_method(const std::string& name, F handler, MethodOptions options = {}) {
+        register_async_method(name, AsyncRequestHandler([handler = std::move(handler)](Context ctx, const json& params) mutable {
+            handler(std::move(ctx), params);
+            }), options);
+    }
+
+    // Register a sync method.
+    // Wraps the sync handler into an async one.
+    void register_method(const std::string& name, RequestHandler handler, MethodOptions options = {}) {
+        register_async_method(name, [handler](Context ctx, const json& params) {
+            try {
+                // Call user logic, get result, reply immediately
+                json res = handler(params);
+                ctx.reply(std::move(res));
+            } catch (const JsonRpcException& e) {
+                // Allow handler to throw JsonRpcException directly.
+                ctx.error(e.code, e.what(), e.data);
+            } catch (const std::exception& e) {
+                // Catch generic exceptions as Internal Error.
+                ctx.error(spec::kInternalError, e.what());
+            }
+            }, options);
+    }
+
+    // Register a sync method taking typed positional params:
+    //     conn.register_method<int64_t, std::array<int, 4>>("wv/resize",
+    //         [](int64_t id, std::array<int, 4> bounds) -> json { ... });
+    // The params array is decoded into Args by ParamTraits before the
+    // handler runs; a wrong count or type is answered with InvalidParams.
+    // A handler returning void replies null.
+    template <typename... Args, typename F>
+        requires (sizeof...(Args) > 0) && std::is_invocable_v<F&, Args...>
+    void register_method(const std::string& name, F handler, MethodOptions options = {}) {
+        register_method(name, RequestHandler([handler = std::move(handler)](const json& params) mutable -> json {
+            auto args = details::decode_params<Args...>(params);
+            if constexpr (std::is_void_v<std::invoke_result_t<F&, Args...>>) {
+                std::apply(handler, std::move(args));
+                return nullptr;
+            } else {
+                return std::apply(handler, std::move(args));
+            }
+            }), options);
+    }
+
+    // Register a notification handler.
+    void register_notification(const std::string& name, NotificationHandler handler, MethodOptions options = {}) {
+        register_async_method(name, [handler](Context ctx, const json& params) {
+            if (ctx.is_notification()) {
+                handler(params);
+            } else {
+                ctx.error(spec::kInvalidRequest, "Notification handler expects no id");
+            }
+            }, options);
+    }
+
+    // Register a notification handler taking typed positional params, see
+    // register_method<Args...>(). Params that do not match are dropped.
+    template <typename... Args, typename F>
+        requires (sizeof...(Args) > 0) && std::is_invocable_v<F&, Args...>
+    void register_notification(const std::string& name, F handler, MethodOptions options = {}) {
+        register_notification(name, NotificationHandler([handler = std::move(handler)](const json& params) mutable {
+            std::apply(handler, details::decode_params<Args...>(params));
+            }), options);
+    }
+
+    // Send a Request to the other side, with a callback for the response.
+    // Without an answer within `timeout` the callback gets a RequestTimeout
+    // error instead, from process_queue(), and a late answer is dropped.
+    static constexpr std::chrono::milliseconds kDefaultRequestTimeout{ 30000 };
+    void send_request(const std::string& method, const json& params, ResponseHandler callback,
+                      std::chrono::milliseconds timeout = kDefaultRequestTimeout) {
+        int id = add_pending(std::move(callback), timeout);
+        if (id) send_frame(encoder(encoding()).request(id, method, params));
+    }
+
+    // Awaitable send_request() for Task handlers, giving the Response:
+    //     Response r = co_await conn.request("emacs/confirm", {"Allow?"}, 10s);
+    // The coroutine resumes on the thread that calls process_queue().
+    auto request(std::string method, json params = nullptr,
+                 std::chrono::milliseconds timeout = kDefaultRequestTimeout) {
+        return ResponseAwaiter([this, method = std::move(method), params = std::move(params), timeout](ResponseHandler done) {
+            send_request(method, params, std::move(done), timeout);
+            });
+    }
+
+    // Run registered method `method` here and now, as if the peer had
+    // requested it, and hand its reply to `done` instead of sending it.
+    // For methods made of others, like a multi-call. The call is part of
+    // request `parent`: it shares its id (a streamed result goes out under
+    // it) and is cancelled with it, answering `done` with RequestCancelled.
+    void invoke(const Context& parent, std::string_view method, const json& params, ResponseHandler done) {
+        int id = parent.id().value_or(0);
+        MethodId m = method_id(method);
+        if (m == kNoMethod) {
+            done(Response::make_error(id, spec::kMethodNotFound, spec::msg_MethodNotFound, std::string(method)));
+            return;
+        }
+        auto state = std::make_shared<details::RequestState>();
+        state->local_reply = std::move(done);
+        parent.cancellation().on_cancel([id, weak = std::weak_ptr<details::RequestState>(state)] {
+            if (auto state = weak.lock()) {
+                cancel_state(*state, id);
+            }
+            });
+        Context ctx(*this, id, nullptr, parent.encoding(), state);
+        try {
+            methods_[m].handler(ctx, params);
+        } catch (const JsonRpcException& e) {
+            ctx.error(e.code, e.what(), e.data);
+        } catch (const std::exception& e) {
+            ctx.error(spec::kInternalError, e.what());
+        }
+    }
+
+    // Awaitable invoke(), for Task handlers.
+    auto invoke(const Context& parent, std::string method, json params = nullptr) {
+        return ResponseAwaiter([this, &parent, method = std::move(method), params = std::move(params)](ResponseHandler done) {
+            invoke(parent, method, params, std::move(done));
+            });
+    }
+
+    // When process_queue() next has a request deadline to enforce, nullopt
+    // with none pending. An event loop that sleeps should wake by then.
+    std::optional<std::chrono::steady_clock::time_point> next_deadline() const {
+        std::lock_guard<std::mutex> lock(callback_mutex_);
+        return pending_requests_.next_deadline();
+    }
+
+    // Coalesce outgoing notifications of `method` per target, the "id"
+    // member or first element of their params. The first one for a target
+    // goes out at once and opens a window; notifications sent during it
+    // only replace the pending one, which the writer flushes when the window
+    // ends (and a new window opens). So a target gets at most one per window
+    // and always ends on the latest value. Use it for state updates like
+    // titles, never for events such as input. Set before start().
+    void coalesce_notifications(const std::string& method, std::chrono::milliseconds window) {
+        if (running_) {
+            throw std::runtime_error("JSON-RPC Error: Cannot change coalescing after server start");
+        }
+        coalesce_windows_[method] = window;
+    }
+
+    // Send a notification to other side.
+    void send_notification(const std::string& method, const json& params = nullptr) {
+        if (!coalesce_windows_.empty()) {
+            auto it = coalesce_windows_.find(method);
+            if (it != coalesce_windows_.end()) {
+                if (auto target = coalesce_target(params)) {
+                    send_coalesced(it->first, *target, it->second,
+                                   encoder(encoding()).request(std::nullopt, method, params));
+                    return;
+                }
+            }
+        }
+        send_frame(encoder(encoding()).request(std::nullopt, method, params));
+    }
+
+    // Groups outgoing notifications and requests into a single batch frame,
+    // which is sent by send() or on destruction. Only use it with peers that
+    // understand JSON-RPC batches; Emacs's jsonrpc.el does not.
+    class Batch {
+    public:
+        explicit Batch(Conn& conn) : conn_(conn), body_(conn.encoding()) {}
+        Batch(const Batch&) = delete;
+        Batch& operator=(const Batch&) = delete;
+        ~Batch() { send(); }
+
+        void notify(std::string_view method, const json& params = nullptr) {
+            encoder(body_.encoding()).request(std::nullopt, method, params);
+            append_encoded();
+        }
+
+        void request(std::string_view method, const json& params, ResponseHandler callback,
+                     std::chrono::milliseconds timeout = kDefaultRequestTimeout) {
+            int id = conn_.add_pending(std::move(callback), timeout);
+            if (!id) return;
+            encoder(body_.encoding()).request(id, method, params);
+            append_encoded();
+        }
+
+        bool empty() const { return body_.size() == 0; }
+
+        void send() {
+            if (body_.size() == 0) return;
+            auto& enc = encoder(body_.encoding());
+            if (body_.size() == 1) {
+                // A lone message needs no array around it.
+                conn_.send_frame(enc.wrap(body_.items()));
+            } else {
+                conn_.send_frame(enc.wrap(body_.finish()));
+            }
+            body_.clear();
+        }
+
+    private:
+        Conn& conn_;
+        ArrayBody body_;
+
+        // Append the message just encoded by this thread's encoder.
+        void append_encoded() {
+            body_.add(encoder(body_.encoding()).body());
+        }
+    };
+
+    // Start an outgoing batch.
+    Batch batch() { return Batch(*this); }
+
+    // Public method to reply with success (used by Context).
+    void send_response_success(int id, json result) {
+        send_frame(encoder(encoding()).result(id, result));
+    }
+    // Public method to reply with error (used by COntext).
+    void send_response_error(int id, int code, std::string msg, json data = nullptr) {
+        send_frame(encoder(encoding()).error(id, code, msg, data));
+    }
+
+    // Main Loop Processor: Call this from your main thread/event loop.
+    // Interactive lane first; past the budget, re-fires the waker and returns false.
+    bool process_queue(DispatchBudget budget = {}) {
+        wake_pending_.exchange(false, std::memory_order_seq_cst);
+        expire_requests();
+        auto start = std::chrono::steady_clock::now();
+        size_t processed = 0;
+        Inbound in;
+        while (pop_next(in)) {
+            if (in.merge && !take_merged(in)) continue;
+            auto now = std::chrono::steady_clock::now();
+            record_queue_latency(in.lane, now - in.queued_at);
+            if (in.method != kNoMethod) {
+                method_stats_[in.method].queue.record(now - in.queued_at);
+            }
+            if (trace::enabled()) {
+                trace::async_span("rpc", "queue", in.queued_at, now, request_id_of(in.msg),
+                                  in.method != kNoMethod ? methods_[in.method].trace_name : nullptr);
+            }
+            dispatch(in);
+            processed++;
+            if (processed >= budget.max_messages ||
+                std::chrono::steady_clock::now() - start >= budget.max_time) {
+                if (pending() == 0) return true;
+                // Yield to the event loop and ask to be called again.
+                wake();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Queueing latency of a lane since the last reset. Call from the main thread.
+    LaneStats lane_stats(Lane lane) const {
+        const auto& l = lane_latency_[(size_t)lane];
+        LaneStats st;
+        st.count = l.count;
+        st.total = l.total;
+        st.max = l.max;
+        st.queued = inbox_[(size_t)lane].size();
+        return st;
+    }
+
+    void reset_lane_stats() {
+        for (auto& l : lane_latency_) {
+            l = LaneLatency{};
+        }
+    }
+
+    // Latency per method and per lane, in microseconds:
+    // {"methods": {name: {"queue": h, "run": h, "reply": h}}, "lanes": {...},
+    //  "outbox": {...}}, where h is a LatencyHistogram::summary(). "queue" is
+    // the time from reader-thread parse to dispatch, "run" the handler call,
+    // and "reply" the time from dispatch until the (possibly async) reply.
+    // Methods that saw no traffic are left out; methods with a MergePolicy
+    // also report "merged" and "dropped" notifications. "alloc" holds alloc_stats()
+    // unless built with JSONRPC_NO_ARENA, "blobs" the blob region once the
+    // peer opened one. Call from the main thread.
+    json stats_json() const {
+        json methods = json::object();
+        for (size_t i = 0; i < methods_.size(); i++) {
+            const auto& st = method_stats_[i];
+            if (st.queue.count() == 0 && st.reply.count() == 0) continue;
+            json& m = methods[methods_[i].name] = {
+                {"queue", st.queue.summary()}, {"run", st.run.summary()}, {"reply", st.reply.summary()},
+            };
+            if (st.merged || st.dropped) {
+                m["merged"] = st.merged;
+                m["dropped"] = st.dropped;
+            }
+        }
+        json lanes = json::object();
+        const char* lane_names[kLaneCount] = { "interactive", "bulk" };
+        for (size_t i = 0; i < kLaneCount; i++) {
+            LaneStats l = lane_stats((Lane)i);
+            lanes[lane_names[i]] = {
+                {"count", l.count}, {"mean", l.mean().count()}, {"max", l.max.count()}, {"queued", l.queued},
+            };
+        }
+        OutboxStats o = outbox_stats();
+        json outbox = {
+            {"queued_frames", o.queued_frames}, {"queued_bytes", o.queued_bytes},
+            {"frames_written", o.frames_written}, {"writes", o.writes},
+            {"coalesced", o.coalesced}, {"suppressed", o.suppressed},
+        };
+        json stats = { {"methods", methods}, {"lanes", lanes}, {"outbox", outbox} };
+        {
+            std::lock_guard<std::mutex> lock(callback_mutex_);
+            stats["requests_pending"] = pending_requests_.size();
+        }
+        if (blobs_.is_open()) {
+            blob::Region::Stats b = blobs_.stats();
+            stats["blobs"] = {
+                {"capacity", b.capacity}, {"used", b.used}, {"live", b.live}, {"fallbacks", b.fallbacks},
+            };
+        }
+#ifndef JSONRPC_NO_ARENA
+        AllocStats a = alloc_stats();
+        stats["alloc"] = {
+            {"arenas", a.arenas}, {"arena_allocs", a.arena_allocs}, {"arena_bytes", a.arena_bytes},
+            {"heap_allocs", a.heap_allocs}, {"held_bytes", a.held_bytes},
+        };
+#endif
+        return stats;
+    }
+
+    // Clear the method histograms and the lane statistics.
+    void reset_stats() {
+        for (size_t i = 0; i < methods_.size(); i++) {
+            method_stats_[i].queue.reset();
+            method_stats_[i].run.reset();
+            method_stats_[i].reply.reset();
+            method_stats_[i].merged = 0;
+            method_stats_[i].dropped = 0;
+        }
+        reset_lane_stats();
+    }
+
+private:
+    friend class Context;
+
+    // Latest queued notification of one (method, key) pair, within one run.
+    struct MergeSlot {
+        std::pair<MethodId, int64_t> key;
+        uint64_t run = 0;    // merge_run_ of the newest pushed.
+        uint64_t latest = 0; // Sequence number of the newest pushed.
+        size_t queued = 0;   // Of its notifications, those still in the inbox.
+        json carry;          // Folded older params; main thread only.
+    };
+
+    // An incoming message as queued by the reader thread.
+    struct Inbound {
+        IncomingMessage msg;
+        // Reply collector when the message is part of a batch.
+        std::shared_ptr<BatchReply> batch;
+        // Method resolved by the reader thread, for requests.
+        MethodId method = kNoMethod;
+        Lane lane = Lane::Interactive;
+        Encoding encoding = Encoding::Json; // Of the frame, for the reply.
+        std::chrono::steady_clock::time_point queued_at{};
+        // Merge key slot and sequence number, for methods with a MergePolicy.
+        std::shared_ptr<MergeSlot> merge{};
+        uint64_t merge_seq = 0;
+    };
+
+    // Entry of the frozen method table, sorted by name.
+    struct MethodEntry {
+        std::string name;
+        AsyncRequestHandler handler;
+        MethodOptions options;
+        const char* trace_name = nullptr; // Interned by start(), outlives the Conn.
+    };
+
+    // Accumulated queueing latency of one lane. Main thread only.
+    struct LaneLatency {
+        uint64_t count = 0;
+        std::chrono::microseconds total{ 0 };
+        std::chrono::microseconds max{ 0 };
+    };
+
+    std::atomic<bool> running_;
+    std::thread reader_thread_;
+    Waker waker_;
+
+    size_t max_content_length_;
+    FrameReader reader_;
+    ByteSink sink_;
+
+    // Outbound queue: senders append whole frames, the writer thread swaps
+    // the buffer out and writes everything pending in one call.
+    std::thread writer_thread_;
+    std::mutex out_mutex_;
+    std::condition_variable out_cv_;
+    std::string outbox_;
+    size_t outbox_frames_ = 0;
+    bool writer_stop_ = false;
+    bool out_closed_ = false; // Set once a write fails.
+    std::atomic<size_t> out_queued_frames_{ 0 };
+    std::atomic<size_t> out_queued_bytes_{ 0 };
+    std::atomic<uint64_t> out_frames_written_{ 0 };
+    std::atomic<uint64_t> out_writes_{ 0 };
+
+    // Coalesced notifications, see coalesce_notifications(). The windows
+    // are fixed by start(); the pending state is guarded by out_mutex_.
+    struct Coalesced {
+        std::chrono::steady_clock::time_point window_end;
+        std::chrono::milliseconds window{ 0 };
+        std::string frame; // Latest unsent notification, if any.
+    };
+    std::unordered_map<std::string, std::chrono::milliseconds> coalesce_windows_;
+    std::map<std::pair<std::string_view, int64_t>, Coalesced> coalesced_;
+    std::atomic<uint64_t> out_coalesced_{ 0 };
+    std::atomic<uint64_t> out_suppressed_{ 0 };
+
+    // Traffic log, see start_recording().
+    record::Recorder recorder_;
+    // Shared region for large binary replies, see $/blob/open.
+    blob::Region blobs_;
+
+    // One queue per Lane, in priority order.
+    SpscQueue<Inbound> inbox_[kLaneCount]{
+        SpscQueue<Inbound>(kInboxCapacity), SpscQueue<Inbound>(kInboxCapacity)
+    };
+    LaneLatency lane_latency_[kLaneCount];
+
+    // Latency histograms of a method, indexed like methods_.
+    struct MethodStats {
+        LatencyHistogram queue;
+        LatencyHistogram run;
+        LatencyHistogram reply;
+        uint64_t merged = 0;  // Folded into a newer notification; main thread only.
+        uint64_t dropped = 0; // Superseded without a fold; main thread only.
+    };
+    std::unique_ptr<MethodStats[]> method_stats_;
+    // Slots of the merged notifications in the inbox, created by the reader
+    // thread and erased by the main thread once the last one is taken. A
+    // slot replaced by a new run lives on in the Inbounds of the old one.
+    std::mutex merge_mutex_; // Guards merge_slots_ and latest/queued.
+    std::map<std::pair<MethodId, int64_t>, std::shared_ptr<MergeSlot>> merge_slots_;
+    // Bumped by the reader whenever the method of the inbound changes, so
+    // runs of one method never merge across another message.
+    uint64_t merge_run_ = 0;
+    MethodId merge_last_method_ = kNoMethod;
+    // Set by the reader when it fires the waker, cleared by process_queue().
+    std::atomic<bool> wake_pending_{ false };
+    std::atomic<Encoding> encoding_{ Encoding::Json };
+
+    // Runs AnyThread requests; started by start() when any are registered.
+    size_t worker_count_ = kDefaultWorkers;
+    WorkerPool workers_;
+
+    // Async requests awaiting a reply, for $/cancelRequest.
+    static constexpr size_t kMinPruneInFlight = 64;
+    std::mutex in_flight_mutex_;
+    std::unordered_map<int, std::weak_ptr<details::RequestState>> in_flight_;
+    size_t prune_in_flight_at_ = kMinPruneInFlight;
+    // Requests read but not dispatched yet, and whether they were cancelled
+    // meanwhile; guarded by in_flight_mutex_.
+    std::unordered_map<int, bool> queued_requests_;
+    mutable std::mutex callback_mutex_;
+    RawHandler raw_handler_;
+    std::map<std::string, MethodEntry> method_handlers_;
+    std::vector<MethodEntry> methods_; // Built from method_handlers_ by start().
+    details::PendingRequests pending_requests_; // Guarded by callback_mutex_.
+
+    std::ostream& err_;
+
+    // Each sending thread encodes into its own reusable frame buffer.
+    // This thread's encoder, switched to `enc`.
+    static FrameEncoder& encoder(Encoding enc) {
+        thread_local FrameEncoder encoder;
+        encoder.set_encoding(enc);
+        return encoder;
+    }
+
+    // Thread-safe frame sender.
+    // Only queues the frame; the writer thread performs the pipe I/O, so the
+    // calling (UI) thread never blocks on a slow reader at the other end.
+    // Emacs's jsonrpc use a HTTP-like framing with Content-Length header,
+    // Content-Length: <length>\r\n\r\n<body>, already built by FrameEncoder.
+    void send_frame(std::string_view frame) {
+        {
+            std::lock_guard<std::mutex> lock(out_mutex_);
+            if (out_closed_) return;
+            outbox_.append(frame);
+            outbox_frames_++;
+            out_queued_frames_.fetch_add(1, std::memory_order_relaxed);
+            out_queued_bytes_.fetch_add(frame.size(), std::memory_order_relaxed);
+        }
+        out_cv_.notify_one();
+    }
+
+    void write_loop() {
+        trace::set_thread_name("jsonrpc writer");
+        std::string batch;
+        std::unique_lock<std::mutex> lock(out_mutex_);
+        while (true) {
+            // Coalesced notifications whose window ended, all of them once
+            // stopping. With nothing to write, sleep until a sender wakes us
+            // or the next window ends.
+            auto deadline = flush_coalesced(writer_stop_);
+            if (outbox_.empty()) {
+                if (writer_stop_) break; // Stopped and fully drained.
+                if (deadline) {
+                    out_cv_.wait_until(lock, *deadline);
+                } else {
+                    out_cv_.wait(lock, [this]() { return !outbox_.empty() || writer_stop_; });
+                }
+                continue;
+            }
+            // Swap buffers so senders keep appending while we write.
+            batch.swap(outbox_);
+            size_t frames = std::exchange(outbox_frames_, 0);
+            lock.unlock();
+
+            recorder_.append(record::Kind::Out, 0, batch);
+            bool ok;
+            {
+                trace::Span span("rpc", "write");
+                ok = sink_(batch.data(), batch.size());
+            }
+            out_queued_frames_.fetch_sub(frames, std::memory_order_relaxed);
+            out_queued_bytes_.fetch_sub(batch.size(), std::memory_order_relaxed);
+            out_frames_written_.fetch_add(frames, std::memory_order_relaxed);
+            out_writes_.fetch_add(1, std::memory_order_relaxed);
+            batch.clear();
+
+            lock.lock();
+            if (!ok) {
+                // The other side is gone; drop whatever is left.
+                out_closed_ = true;
+                out_queued_frames_ = 0;
+                out_queued_bytes_ = 0;
+                outbox_frames_ = 0;
+                outbox_.clear();
+                coalesced_.clear();
+                break;
+            }
+        }
+    }
+
+    // Target of a coalesced notification: params.id, or params[0].
+    static std::optional<int64_t> coalesce_target(const json& params) {
+        const json* id = nullptr;
+        if (params.is_object()) {
+            auto it = params.find("id");
+            if (it != params.end()) id = &*it;
+        } else if (params.is_array() && !params.empty()) {
+            id = &params[0];
+        }
+        if (id && id->is_number_integer()) return id->get<int64_t>();
+        return std::nullopt;
+    }
+
+    // Send now if the target has no open window, else hold as the pending
+    // frame. `method` must outlive the connection (a coalesce_windows_ key).
+    void send_coalesced(std::string_view method, int64_t target, std::chrono::milliseconds window,
+                        std::string_view frame) {
+        auto now = std::chrono::steady_clock::now();
+        out_coalesced_.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(out_mutex_);
+            if (out_closed_) return;
+            auto& c = coalesced_[{ method, target }];
+            if (now >= c.window_end && c.frame.empty()) {
+                // Leading edge.
+                c.window = window;
+                c.window_end = now + window;
+                outbox_.append(frame);
+                outbox_frames_++;
+                out_queued_frames_.fetch_add(1, std::memory_order_relaxed);
+                out_queued_bytes_.fetch_add(frame.size(), std::memory_order_relaxed);
+            } else {
+                if (!c.frame.empty()) {
+                    out_suppressed_.fetch_add(1, std::memory_order_relaxed);
+                }
+                c.frame.assign(frame);
+            }
+        }
+        out_cv_.notify_one();
+    }
+
+    // Writer thread, under out_mutex_: move pending coalesced frames whose
+    // window ended (or all, if `all`) to the outbox and open a new window;
+    // forget targets idle for a whole window. Returns the next window end.
+    std::optional<std::chrono::steady_clock::time_point> flush_coalesced(bool all) {
+        if (coalesced_.empty()) return std::nullopt;
+        auto now = std::chrono::steady_clock::now();
+        std::optional<std::chrono::steady_clock::time_point> next;
+        for (auto it = coalesced_.begin(); it != coalesced_.end();) {
+            auto& c = it->second;
+            if (!all && now < c.window_end) {
+                if (!next || c.window_end < *next) next = c.window_end;
+                ++it;
+                continue;
+            }
+            if (c.frame.empty()) {
+                it = coalesced_.erase(it);
+                continue;
+            }
+            // Trailing edge.
+            outbox_.append(c.frame);
+            outbox_frames_++;
+            out_queued_frames_.fetch_add(1, std::memory_order_relaxed);
+            out_queued_bytes_.fetch_add(c.frame.size(), std::memory_order_relaxed);
+            c.frame.clear();
+            c.window_end = now + c.window;
+            if (!next || c.window_end < *next) next = c.window_end;
+            ++it;
+        }
+        return next;
+    }
+
+    // Helper: Send a protocol-level error where id is null.
+    // Used when we cannot parse the request or the ID is invalid.
+    void send_protocol_error(int code, std::string_view msg, Encoding enc, const json& data = nullptr) {
+        // id must be null for protocol errors.
+        send_frame(encoder(enc).error(std::nullopt, code, msg, data));
+    }
+
+    // Compile the registered handlers into a sorted flat table. Registration
+    // is closed while running, so the table never changes under the reader.
+    void freeze_methods() {
+        methods_.clear();
+        methods_.reserve(method_handlers_.size());
+        for (const auto& [name, entry] : method_handlers_) {
+            methods_.push_back(entry);
+            methods_.back().trace_name = trace::intern(name);
+        }
+        method_stats_ = std::make_unique<MethodStats[]>(methods_.size());
+    }
+
+    // Wrap a decoded message for the inbox with its method, lane (interactive
+    // for responses and unknown methods) and, if it has a merge key, slot.
+    Inbound make_inbound(IncomingMessage& msg, std::shared_ptr<BatchReply> batch, Encoding enc) {
+        Inbound in{ std::move(msg), std::move(batch) };
+        in.encoding = enc;
+        if (auto req = std::get_if<Request>(&in.msg)) {
+            in.method = method_id(req->method);
+            if (req->id.has_value()) {
+                std::lock_guard<std::mutex> lock(in_flight_mutex_);
+                queued_requests_.emplace(req->id.value(), false);
+            }
+        }
+        if (in.method == kNoMethod || in.method != merge_last_method_) merge_run_++;
+        merge_last_method_ = in.method;
+        if (auto req = std::get_if<Request>(&in.msg)) {
+            if (in.method != kNoMethod) {
+                const auto& options = methods_[in.method].options;
+                in.lane = options.lane;
+                if (options.merge && !req->id.has_value()) {
+                    std::optional<int64_t> key;
+                    try {
+                        key = options.merge.key(req->params);
+                    } catch (...) {
+                        // Malformed params: not merged, the handler will see them.
+                    }
+                    if (key) {
+                        std::lock_guard<std::mutex> lock(merge_mutex_);
+                        auto& slot = merge_slots_[{ in.method, *key }];
+                        if (!slot || slot->run != merge_run_) {
+                            // Another message came between: leave the old
+                            // run to its newest and start over.
+                            slot = std::make_shared<MergeSlot>();
+                            slot->key = { in.method, *key };
+                            slot->run = merge_run_;
+                        }
+                        in.merge = slot;
+                        in.merge_seq = ++slot->latest;
+                        slot->queued++;
+                    }
+                }
+            }
+        }
+        return in;
+    }
+
+    // Apply the merge policy of a queued notification. Returns false if a
+    // newer one with the same key is queued, after dropping this one or
+    // folding it into the carry the newest picks up.
+    bool take_merged(Inbound& in) {
+        MergeSlot& slot = *in.merge;
+        auto& params = std::get<Request>(in.msg).params;
+        const auto& fold = methods_[in.method].options.merge.fold;
+        auto& st = method_stats_[in.method];
+        std::unique_lock<std::mutex> lock(merge_mutex_);
+        slot.queued--;
+        if (slot.latest != in.merge_seq) {
+            // The newer one is still queued, so the slot stays.
+            lock.unlock();
+            if (fold) {
+                if (!slot.carry.is_null()) fold(params, slot.carry);
+                slot.carry = std::move(params);
+                st.merged++;
+            } else {
+                st.dropped++;
+            }
+            return false;
+        }
+        json carry = std::move(slot.carry);
+        if (slot.queued == 0) {
+            auto it = merge_slots_.find(slot.key);
+            if (it != merge_slots_.end() && it->second == in.merge) merge_slots_.erase(it);
+        }
+        lock.unlock();
+        if (fold && !carry.is_null()) fold(params, carry);
+        return true;
+    }
+
+    // Pop from the highest-priority non-empty lane.
+    bool pop_next(Inbound& in) {
+        for (auto& lane : inbox_) {
+            if (lane.try_pop(in)) return true;
+        }
+        return false;
+    }
+
+    size_t pending() const {
+        size_t n = 0;
+        for (const auto& lane : inbox_) {
+            n += lane.size();
+        }
+        return n;
+    }
+
+    void record_queue_latency(Lane lane, std::chrono::steady_clock::duration d) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d);
+        auto& l = lane_latency_[(size_t)lane];
+        l.count++;
+        l.total += us;
+        if (us > l.max) l.max = us;
+    }
+
+    void dispatch(Inbound& in) {
+        auto& msg = in.msg;
+        // 1. Raw Handler Interception.
+        if (raw_handler_ && raw_handler_(msg, *this)) {
+            return;
+        }
+        // 2. Dispatch based on message type.
+        std::visit([this, &in](auto&& arg) {
+            using T = std::decay_t<decltype(arg)>;
+            if constexpr (std::is_same_v<T, Request>) {
+                handle_request(arg, in.method, std::move(in.batch), in.encoding);
+            } else if constexpr (std::is_same_v<T, Response>) {
+                handle_response(arg);
+            } else if constexpr (std::is_same_v<T, Error>) {
+                // Handle "Global Error", usually a Protocol Error from peer.
+                // Log to stderr as it cannot be replied to.
+                err_ << "[JSON-RPC FATAL ERROR] Code: " << arg.code
+                    << ", Message: " << arg.message << std::endl;
+                if (!arg.data.is_null()) {
+                    err_ << "Data: " << arg.data.dump() << std::endl;
+                }
+            }
+        }, msg);
+    }
+
+    // On a worker the request is tracked before the handler runs, since
+    // the main thread may cancel it meanwhile.
+    void handle_request(const Request& req, MethodId method, std::shared_ptr<BatchReply> batch = nullptr,
+                        Encoding enc = Encoding::Json, bool on_worker = false) {
+        trace::Span span("rpc", "dispatch", req.id.value_or(-1), -1,
+                         method != kNoMethod ? methods_[method].trace_name : nullptr);
+        std::shared_ptr<details::RequestState> state;
+        auto start = std::chrono::steady_clock::now();
+        if (req.id.has_value()) {
+            state = std::make_shared<details::RequestState>();
+            if (method != kNoMethod) {
+                state->method = method;
+                state->dispatched = start;
+            }
+            if (take_queued(req.id.value(), on_worker ? state : nullptr)) {
+                send_reply(batch, encoder(enc).error(req.id, spec::kRequestCancelled,
+                                                     spec::msg_RequestCancelled, nullptr));
+                return;
+            }
+        }
+        Context ctx(*this, req.id, std::move(batch), enc, state);
+        if (method != kNoMethod) {
+            // Record the run time on every exit from the handler.
+            struct RunTimer {
+                LatencyHistogram& hist;
+                std::chrono::steady_clock::time_point start;
+                ~RunTimer() { hist.record(std::chrono::steady_clock::now() - start); }
+            } run_timer{ method_stats_[method].run, start };
+            try {
+                // Pass Context to handler. It is responsible for replying.
+                methods_[method].handler(ctx, req.params);
+            } catch (const JsonRpcException& e) {
+                ctx.error(e.code, e.what(), e.data);
+            } catch (const std::exception& e) {
+                // User threw a generic exception -> Internal Error
+                ctx.error(spec::kInternalError, e.what());
+            }
+        } else {
+            // Method not found.
+            ctx.error(spec::kMethodNotFound, spec::msg_MethodNotFound, req.method);
+        }
+        // Still unanswered: an async handler. Make it reachable by id.
+        if (state && !on_worker) {
+            track_request(req.id.value(), state);
+        }
+    }
+
+    // Id of a request or response, -1 if it has none (for tracing).
+    static int64_t request_id_of(const IncomingMessage& msg) {
+        if (auto req = std::get_if<Request>(&msg)) return req->id.value_or(-1);
+        if (auto resp = std::get_if<Response>(&msg)) return resp->id;
+        return -1;
+    }
+
+    void track_request(int id, const std::shared_ptr<details::RequestState>& state) {
+        std::lock_guard<std::mutex> state_lock(state->mutex);
+        if (state->replied) return;
+        std::lock_guard<std::mutex> lock(in_flight_mutex_);
+        add_in_flight(id, state);
+    }
+
+    // Forget a queued request as it is dispatched. True if it was cancelled
+    // meanwhile; else `track`, if set, is tracked in the same step, so a
+    // cancel from the main thread finds the request in one place or the other.
+    bool take_queued(int id, const std::shared_ptr<details::RequestState>& track) {
+        std::unique_lock<std::mutex> state_lock;
+        if (track) state_lock = std::unique_lock<std::mutex>(track->mutex);
+        std::lock_guard<std::mutex> lock(in_flight_mutex_);
+        bool cancelled = false;
+        if (auto it = queued_requests_.find(id); it != queued_requests_.end()) {
+            cancelled = it->second;
+            queued_requests_.erase(it);
+        }
+        if (!cancelled && track) add_in_flight(id, track);
+        return cancelled;
+    }
+
+    // Caller holds state->mutex and in_flight_mutex_.
+    void add_in_flight(int id, const std::shared_ptr<details::RequestState>& state) {
+        if (in_flight_.size() >= prune_in_flight_at_) {
+            // Forget requests whose handlers dropped the Context unanswered.
+            std::erase_if(in_flight_, [](const auto& kv) { return kv.second.expired(); });
+            prune_in_flight_at_ = (std::max)(kMinPruneInFlight, 2 * in_flight_.size());
+        }
+        in_flight_[id] = state;
+        state->tracked = true;
+    }
+
+    void abandon_requests() {
+        std::vector<std::shared_ptr<details::RequestState>> states;
+        {
+            std::lock_guard<std::mutex> lock(in_flight_mutex_);
+            for (auto& [id, weak] : in_flight_) {
+                if (auto state = weak.lock()) states.push_back(std::move(state));
+            }
+            in_flight_.clear();
+            queued_requests_.clear();
+        }
+        for (auto& state : states) {
+            std::vector<std::function<void()>> callbacks;
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (state->replied) continue;
+                state->replied = true;
+                state->cancelled = true;
+                callbacks.swap(state->on_cancel);
+            }
+            for (auto& cb : callbacks) {
+                cb();
+            }
+        }
+    }
+
+    // Mark a request cancelled and run its cancellation callbacks. A local
+    // call, see invoke(), is answered at once with RequestCancelled under
+    // `id`: its handler no longer will.
+    static void cancel_state(details::RequestState& state, int id = 0) {
+        std::vector<std::function<void()>> callbacks;
+        ResponseHandler local_reply;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.replied || state.cancelled) return;
+            state.cancelled = true;
+            callbacks.swap(state.on_cancel);
+            if (state.local_reply) {
+                state.replied = true;
+                local_reply = std::move(state.local_reply);
+            }
+        }
+        for (auto& cb : callbacks) {
+            cb();
+        }
+        if (local_reply) {
+            local_reply(Response::make_error(id, spec::kRequestCancelled, spec::msg_RequestCancelled));
+        }
+    }
+
+    // A request answered: count its reply latency and forget it. Never
+    // reached once abandon_requests() marked it replied, see Context::settle().
+    void finish_request(int id, MethodId method, std::chrono::steady_clock::time_point dispatched, bool tracked) {
+        if (method != kNoMethod) {
+            method_stats_[method].reply.record(std::chrono::steady_clock::now() - dispatched);
+        }
+        if (tracked) {
+            std::lock_guard<std::mutex> lock(in_flight_mutex_);
+            in_flight_.erase(id);
+        }
+    }
+
+    // Deliver an encoded reply, either directly or as part of its batch.
+    void send_reply(const std::shared_ptr<BatchReply>& batch, std::string_view frame) {
+        if (!batch) {
+            send_frame(frame);
+            return;
+        }
+        std::string array;
+        auto& enc = encoder(batch->encoding());
+        if (batch->add(enc.body(), array)) {
+            send_frame(enc.wrap(array));
+        }
+    }
+
+    void handle_response(const Response& resp) {
+        trace::Span span("rpc", "response", resp.id);
+        ResponseHandler callback = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(callback_mutex_);
+            callback = pending_requests_.take(resp.id);
+        }
+        if (callback) callback(resp);
+    }
+
+    // Id for a new outgoing request. 0 if the table is full, after failing
+    // the callback. Wakes the loop when the request moves next_deadline()
+    // earlier, so a timer armed from it is re-armed even when the request
+    // is sent outside process_queue(), e.g. from a WebView2 completion.
+    int add_pending(ResponseHandler callback, std::chrono::milliseconds timeout) {
+        int id;
+        bool earlier;
+        {
+            std::lock_guard<std::mutex> lock(callback_mutex_);
+            auto before = pending_requests_.next_deadline();
+            id = pending_requests_.add(callback, std::chrono::steady_clock::now() + timeout);
+            earlier = id && pending_requests_.next_deadline() != before;
+        }
+        if (earlier && waker_) waker_();
+        if (!id && callback) {
+            callback(Response::make_error(0, spec::kInternalError, "Too many requests in flight"));
+        }
+        return id;
+    }
+
+    // Fail the outgoing requests past their deadline, or all of them.
+    void expire_requests(bool all = false) {
+        std::vector<std::pair<int, ResponseHandler>> expired;
+        {
+            std::lock_guard<std::mutex> lock(callback_mutex_);
+            if (all) {
+                pending_requests_.take_all(expired);
+            } else {
+                pending_requests_.expire(std::chrono::steady_clock::now(), expired);
+            }
+        }
+        for (auto& [id, callback] : expired) {
+            if (!callback) continue;
+            if (all) {
+                callback(Response::make_error(id, spec::kInternalError, "Connection closed"));
+            } else {
+                callback(Response::make_error(id, spec::kRequestTimeout, spec::msg_RequestTimeout));
+            }
         }
-        if (callback) callback(resp);
     }
 
     void read_loop() {
@@ -606,87 +3802,235 @@ private:
                 if (waker) waker();
             }
         } exit_guard{ running_, waker_ };
-        // A helper function that reads a line and automatically removes '\r' character.
-        auto read_header_line = [this]() -> std::optional<std::string> {
-            std::string line;
-            if (!std::getline(in_, line)) {
-                return std::nullopt;  // EOF or stream error
-            }
-            if (!line.empty() && line.back() == '\r') {
-                line.pop_back();
-            }
-            return line;
-            };
-
+        trace::set_thread_name("jsonrpc reader");
+        MessageDecoder decoder;
+        DecodedFrame frame;
         while (running_) {
-            size_t content_length = 0;
-
-            // 1. Read header.
-            while (true) {
-                auto line = read_header_line();
-                if (!line) return; // EOF
-                if (line->empty()) break;  // End of headers.
-
-                if (line->starts_with("Content-Length:")) {
-                    try {
-                        auto pos = line->find(':');
-                        content_length = std::stoull(line->substr(pos + 1));
-                    } catch (...) { }
-                }
-            }
-            // Invalid content length.
-            if (content_length == 0) {
+            // 1. Read the next frame header.
+            auto status = reader_.next_header();
+            if (status == FrameReader::Status::Eof) return;
+            if (status == FrameReader::Status::MissingLength) {
                 err_ << "[JSON-RPC FATAL] Missing Content-Length header."
                     << std::endl;
                 return;
             }
-            if (content_length > max_content_length_) {
+            if (status == FrameReader::Status::HeaderTooLarge) {
+                err_ << "[JSON-RPC FATAL] Header exceeds " << FrameReader::kMaxHeaderSize
+                    << " bytes. Closing connection." << std::endl;
+                return;
+            }
+            if (status == FrameReader::Status::TooLarge) {
                 err_ << "[JSON-RPC FATAL] Packet too large: "
-                    << content_length << "> " << max_content_length_
+                    << reader_.content_length() << "> " << max_content_length_
                     << ". Closing connection." << std::endl;
                 return;
             }
-            // 2. Read body.
-            std::vector<char> buffer(content_length);
-            in_.read(buffer.data(), content_length);
 
+            // 2. Parse the body. One that fits the read buffer is parsed in
+            // place; a larger one is parsed while it arrives, so the buffer
+            // never grows to the size of the body. Recording needs the whole
+            // body, so it takes the first path.
+            Encoding enc = reader_.encoding();
+            DecodeStatus decoded;
+            if (reader_.content_length() <= reader_.chunk_size() || recorder_.is_open()) {
+                std::string_view body;
+                {
+                    trace::Span span("rpc", "read");
+                    status = reader_.read_body(body);
+                }
+                if (status == FrameReader::Status::Ok) {
+                    recorder_.append(record::Kind::In, (uint8_t)enc, body);
+                    trace::Span span("rpc", "parse");
+                    decoded = decoder.decode(body, frame, enc);
+                }
+            } else {
+                trace::Span span("rpc", "read+parse", -1, -1, "streamed");
+                decoded = decoder.decode(reader_.body_begin(), reader_.body_end(), frame, enc);
+                // A parse error can stop short of the end of the body.
+                if (!reader_.skip_body()) {
+                    status = FrameReader::Status::Incomplete;
+                }
+            }
             // Make sure we read the exact number of bytes specified.
-            if (in_.gcount() != (std::streamsize)content_length) {
+            if (status == FrameReader::Status::Incomplete) {
                 err_ << "[JSON-RPC FATAL] Incomplete body read. "
-                    << "Expected " << content_length << " bytes, but only got " << in_.gcount()
+                    << "Expected " << reader_.content_length() << " bytes, but only got " << reader_.received()
                     << ". Closing connection." << std::endl;
                 return;
             }
 
-            // 3. Parse and Push.
-            try {
-                auto j = json::parse(buffer.begin(), buffer.end());
-                auto msg = Parser::parse(j);
-                inbox_.push(std::move(msg));
+            // 3. Push.
+            if (!decoded.ok()) {
+                // Parse Error, Invalid Request, etc. from the decoder.
+                send_protocol_error(decoded.code, decoded.message, enc);
+                continue;
+            }
+            if (!frame.batch) {
+                if (!push(make_inbound(frame.messages.front(), nullptr, enc))) return;
+            } else {
+                if (!push_batch(frame, enc)) return;
+            }
+        }
+    }
 
-                if (waker_) waker_();
-            } catch (const json::parse_error&) {
-                send_protocol_error(spec::kParseError, spec::msg_ParseError);
-            } catch (const JsonRpcException& e) {
-                // Catch Invalid Request, etc. from Parser.
-                send_protocol_error(e.code, e.what(), e.data);
-            } catch (const std::exception& e) {
-                // Catch-all for unexpected errors during parsing.
-                send_protocol_error(spec::kInvalidRequest, e.what());
+    // Queue a message for the main thread, or for the worker pool if it is
+    // an AnyThread request, waiting while the queue is full.
+    // Returns false if the connection stopped while waiting.
+    bool push(Inbound&& in) {
+        in.queued_at = std::chrono::steady_clock::now();
+        if (in.method != kNoMethod && methods_[in.method].options.affinity == Affinity::AnyThread &&
+            workers_.running()) {
+            return workers_.post([this, in = std::move(in)]() mutable { run_on_worker(in); });
+        }
+        auto& lane = inbox_[(size_t)in.lane];
+        for (int spins = 0; !lane.try_push(in); spins++) {
+            // Make sure the consumer knows there is work, then back off.
+            wake();
+            if (!running_) return false;
+            if (spins < 64) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        wake();
+        return true;
+    }
+
+    // Dispatch an AnyThread request on a pool thread. Its reply goes
+    // straight to the outbox; the main thread is not involved.
+    void run_on_worker(Inbound& in) {
+        auto now = std::chrono::steady_clock::now();
+        method_stats_[in.method].queue.record(now - in.queued_at);
+        if (trace::enabled()) {
+            trace::async_span("rpc", "queue", in.queued_at, now, request_id_of(in.msg),
+                              methods_[in.method].trace_name);
+        }
+        handle_request(std::get<Request>(in.msg), in.method, std::move(in.batch), in.encoding, true);
+    }
+
+    // Fire the waker only on the transition to "work pending", so a burst of
+    // messages costs one wakeup instead of one per message.
+    void wake() {
+        if (!wake_pending_.exchange(true, std::memory_order_seq_cst)) {
+            if (waker_) waker_();
+        }
+    }
+
+    // Queue the elements of a batch. Requests share one reply collector,
+    // which also carries the errors for invalid elements.
+    bool push_batch(DecodedFrame& frame, Encoding enc) {
+        size_t expected = frame.errors.size();
+        for (const auto& msg : frame.messages) {
+            if (auto req = std::get_if<Request>(&msg); req && req->id.has_value()) {
+                expected++;
             }
         }
+        std::shared_ptr<BatchReply> batch;
+        if (expected > 0) {
+            batch = std::make_shared<BatchReply>(expected, enc);
+        }
+        for (const auto& e : frame.errors) {
+            send_reply(batch, encoder(enc).error(std::nullopt, e.code, e.message, nullptr));
+        }
+        for (auto& msg : frame.messages) {
+            bool needs_reply = std::holds_alternative<Request>(msg) && std::get<Request>(msg).id.has_value();
+            if (!push(make_inbound(msg, needs_reply ? batch : nullptr, enc))) return false;
+        }
+        return true;
     }
 };
 
 // Implement Context methods inline after Conn is defined.
+inline bool Context::settle() {
+    if (!state_) return true;
+    bool cancelled = false;
+    bool tracked = false;
+    Conn::MethodId method = Conn::kNoMethod;
+    std::chrono::steady_clock::time_point dispatched;
+    std::vector<std::function<void()>> dropped;
+    {
+        // Past this point the connection is alive: ~Conn marks every request
+        // it still tracks replied (abandon_requests()) before going away.
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if (state_->replied) return false;
+        state_->replied = true;
+        cancelled = state_->cancelled;
+        tracked = state_->tracked;
+        method = state_->method;
+        dispatched = state_->dispatched;
+        dropped.swap(state_->on_cancel);
+    }
+    if (tracked || method != Conn::kNoMethod) {
+        conn_.finish_request(id_.value_or(0), method, dispatched, tracked);
+    }
+    if (cancelled && batch_) {
+        // The batch reply still needs an entry for this request.
+        conn_.send_reply(batch_, Conn::encoder(encoding_).error(id_, spec::kRequestCancelled,
+                                                                spec::msg_RequestCancelled, nullptr));
+    }
+    return !cancelled;
+}
 inline void Context::reply(json result) {
-    if (id_.has_value()) {
-        conn_.send_response_success(id_.value(), std::move(result));
+    trace::Span span("rpc", "reply", id_.value_or(-1));
+    if (id_.has_value() && settle()) {
+        send_result(std::move(result));
+    }
+}
+inline void Context::send_result(json result) {
+    if (state_ && state_->local_reply) {
+        state_->local_reply(Response::make_success(id_.value(), std::move(result)));
+    } else {
+        conn_.send_reply(batch_, Conn::encoder(encoding_).result(id_.value(), result));
     }
 }
 inline void Context::error(int code, std::string message, json data) {
+    trace::Span span("rpc", "reply", id_.value_or(-1), -1, "error");
+    if (id_.has_value() && settle()) {
+        if (state_ && state_->local_reply) {
+            state_->local_reply(Response::make_error(id_.value(), code, std::move(message), std::move(data)));
+        } else {
+            conn_.send_reply(batch_, Conn::encoder(encoding_).error(id_.value(), code, message, data));
+        }
+    }
+}
+inline void Context::stream(json chunk) {
+    if (!id_.has_value() || cancelled()) return;
+    json params = { {"id", id_.value()}, {"seq", stream_seq_++}, {"data", std::move(chunk)} };
+    conn_.send_frame(Conn::encoder(encoding_).request(std::nullopt, "$/streamChunk", params));
+}
+inline void Context::stream_text(std::string_view text, size_t chunk_size) {
+    chunk_size = (std::max)(chunk_size, size_t(4)); // Room for any UTF-8 character.
+    while (!text.empty()) {
+        size_t n = (std::min)(chunk_size, text.size());
+        // Do not split a multi-byte character: back up over continuation bytes.
+        size_t cut = n;
+        while (cut > 0 && cut < text.size() && ((unsigned char)text[cut] & 0xC0) == 0x80) cut--;
+        if (cut > 0) n = cut;
+        stream(std::string(text.substr(0, n)));
+        text.remove_prefix(n);
+    }
+}
+inline void Context::reply_bytes(std::string_view data) {
+    if (!id_.has_value()) return;
+    std::optional<blob::Ref> ref;
+    if (data.size() >= kBlobThreshold && !cancelled()) {
+        ref = conn_.blobs_.put(data);
+    }
+    if (!ref) {
+        reply({ {"base64", blob::base64_encode(data)} });
+        return;
+    }
+    trace::Span span("rpc", "reply", id_.value(), -1, "blob");
+    if (settle()) {
+        send_result({ {"blob", {{"handle", ref->handle}, {"offset", ref->offset}, {"length", ref->length}}} });
+    } else {
+        conn_.blobs_.release(ref->handle); // Cancelled meanwhile, nobody will read it.
+    }
+}
+inline void Context::end_stream() {
     if (id_.has_value()) {
-        conn_.send_response_error(id_.value(), code, std::move(message), std::move(data));
+        reply({ {"stream", id_.value()}, {"chunks", stream_seq_} });
     }
 }
 }  // namespace jsonrpc
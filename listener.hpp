@@ -0,0 +1,394 @@
+// Local server transport: one manager serving several clients at once, each
+// in its own Conn ("session") with its own queue and pending requests.
+//
+// The endpoint is a Unix domain socket path, or on Windows a named pipe
+// (\\.\pipe\name). An accept thread takes connections; the sessions are set
+// up, dispatched and reaped by process_queue() on the thread that calls it,
+// the same thread that dispatches a single Conn.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <sddl.h>
+#else
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+#include "jsonrpc.hpp"
+
+namespace jsonrpc {
+
+namespace details {
+
+#ifdef _WIN32
+using NativeHandle = HANDLE;
+inline const NativeHandle kInvalidHandle = INVALID_HANDLE_VALUE;
+
+inline std::wstring pipe_name(const std::string& endpoint) {
+    int n = MultiByteToWideChar(CP_UTF8, 0, endpoint.data(), (int)endpoint.size(), nullptr, 0);
+    std::wstring name(n > 0 ? n : 0, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, endpoint.data(), (int)endpoint.size(), name.data(), n);
+    return name;
+}
+
+// A security descriptor granting the current user, and no one else, access
+// to the pipe; the default one lets Everyone read it. Null on failure.
+inline std::shared_ptr<void> owner_only_security() {
+    HANDLE token = nullptr;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) return nullptr;
+    DWORD size = 0;
+    GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+    std::vector<char> user(size);
+    bool ok = size > 0 && GetTokenInformation(token, TokenUser, user.data(), size, &size);
+    CloseHandle(token);
+    LPWSTR sid = nullptr;
+    if (!ok || !ConvertSidToStringSidW(((TOKEN_USER*)user.data())->User.Sid, &sid)) return nullptr;
+    std::wstring sddl = L"D:P(A;;GA;;;" + std::wstring(sid) + L")";
+    LocalFree(sid);
+    PSECURITY_DESCRIPTOR sd = nullptr;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl.c_str(), SDDL_REVISION_1, &sd, nullptr)) {
+        return nullptr;
+    }
+    return std::shared_ptr<void>(sd, LocalFree);
+}
+
+// Pipe instances are overlapped: on a synchronous handle Windows runs one
+// I/O at a time, so the writer's WriteFile would wait behind the reader's
+// blocked ReadFile. Each reader or writer waits on its own event.
+inline std::shared_ptr<void> make_event() {
+    return std::shared_ptr<void>(CreateEventW(nullptr, TRUE, FALSE, nullptr), CloseHandle);
+}
+
+// Wait for an overlapped call that returned `ok`. False if it failed or
+// was cancelled by shutdown_handle().
+inline bool finish_io(HANDLE h, BOOL ok, OVERLAPPED& ov, DWORD& n) {
+    if (!ok && GetLastError() != ERROR_IO_PENDING) return false;
+    return GetOverlappedResult(h, &ov, &n, TRUE) != FALSE;
+}
+#else
+using NativeHandle = int;
+inline constexpr NativeHandle kInvalidHandle = -1;
+#endif
+
+inline ByteSource handle_source(NativeHandle h) {
+#ifdef _WIN32
+    return [h, event = make_event()](char* buf, size_t len) -> size_t {
+        OVERLAPPED ov{};
+        ov.hEvent = event.get();
+        DWORD n = 0;
+        BOOL ok = ReadFile(h, buf, (DWORD)(std::min)(len, (size_t)MAXDWORD), nullptr, &ov);
+        return finish_io(h, ok, ov, n) ? n : 0;
+        };
+#else
+    return [h](char* buf, size_t len) -> size_t {
+        for (;;) {
+            ssize_t n = ::recv(h, buf, len, 0);
+            if (n < 0 && errno == EINTR) continue;
+            return n > 0 ? (size_t)n : 0;
+        }
+        };
+#endif
+}
+
+inline ByteSink handle_sink(NativeHandle h) {
+#ifdef _WIN32
+    return [h, event = make_event()](const char* buf, size_t len) -> bool {
+        while (len > 0) {
+            OVERLAPPED ov{};
+            ov.hEvent = event.get();
+            DWORD n = 0;
+            BOOL ok = WriteFile(h, buf, (DWORD)(std::min)(len, (size_t)MAXDWORD), nullptr, &ov);
+            if (!finish_io(h, ok, ov, n) || n == 0) return false;
+            buf += n;
+            len -= n;
+        }
+        return true;
+        };
+#else
+    return [h](const char* buf, size_t len) -> bool {
+        while (len > 0) {
+            // A client that went away must not kill the manager with SIGPIPE.
+            ssize_t n = ::send(h, buf, len, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            buf += n;
+            len -= (size_t)n;
+        }
+        return true;
+        };
+#endif
+}
+
+// Make reads on h fail now and from then on, so a session's reader ends.
+inline void shutdown_handle(NativeHandle h) {
+#ifdef _WIN32
+    DisconnectNamedPipe(h);
+    CancelIoEx(h, nullptr);
+#else
+    ::shutdown(h, SHUT_RDWR);
+#endif
+}
+
+inline void close_handle(NativeHandle h) {
+#ifdef _WIN32
+    CloseHandle(h);
+#else
+    ::close(h);
+#endif
+}
+
+} // namespace details
+
+class Listener {
+public:
+    using SessionId = int64_t;
+    // Registers the methods of a new session. Called before it starts.
+    using Setup = std::function<void(Conn&, SessionId)>;
+    // Called once a session's client is gone and its Conn destroyed, with
+    // its unanswered requests cancelled.
+    using Closed = std::function<void(SessionId)>;
+
+    // The waker is shared by every session, see Conn::Conn().
+    Listener(Conn::Waker waker, Setup setup, Closed closed = nullptr)
+        : waker_(std::move(waker)), setup_(std::move(setup)), closed_(std::move(closed)) {}
+    Listener(const Listener&) = delete;
+    Listener& operator=(const Listener&) = delete;
+    ~Listener() { stop(); }
+
+    // Start accepting clients on endpoint. Returns false if it cannot be
+    // created. The socket or pipe is made accessible to its owner only.
+    bool listen(const std::string& endpoint) {
+        if (accept_thread_.joinable()) return false;
+        endpoint_ = endpoint;
+        stopping_ = false;
+#ifdef _WIN32
+        // Instances are created by the accept loop; check the name is ours
+        // by creating the first one here.
+        pipe_security_ = details::owner_only_security();
+        HANDLE first = create_pipe(true);
+        if (first == INVALID_HANDLE_VALUE) return false;
+        accept_thread_ = std::thread([this, first] { accept_loop(first); });
+#else
+        sockaddr_un addr{};
+        if (endpoint.size() >= sizeof(addr.sun_path)) return false;
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, endpoint.c_str(), endpoint.size() + 1);
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+        ::unlink(endpoint.c_str()); // Left behind by a manager that crashed.
+        if (::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+            ::chmod(endpoint.c_str(), S_IRUSR | S_IWUSR) != 0 ||
+            ::listen(fd, SOMAXCONN) != 0) {
+            ::close(fd);
+            return false;
+        }
+        listen_fd_ = fd;
+        accept_thread_ = std::thread([this] { accept_loop(); });
+#endif
+        return true;
+    }
+
+    bool is_listening() const { return accept_thread_.joinable(); }
+
+    // Stop accepting and end every session. Closed is not called.
+    void stop() {
+        if (accept_thread_.joinable()) {
+            stopping_ = true;
+#ifdef _WIN32
+            // Wake ConnectNamedPipe by connecting to ourselves.
+            HANDLE h = CreateFileW(details::pipe_name(endpoint_).c_str(), GENERIC_READ | GENERIC_WRITE,
+                0, nullptr, OPEN_EXISTING, 0, nullptr);
+            if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+#else
+            ::shutdown(listen_fd_, SHUT_RDWR);
+#endif
+            accept_thread_.join();
+#ifndef _WIN32
+            ::close(listen_fd_);
+            listen_fd_ = -1;
+            ::unlink(endpoint_.c_str());
+#endif
+        }
+        std::vector<std::unique_ptr<Session>> all;
+        {
+            std::lock_guard<std::mutex> lock(incoming_mutex_);
+            all.swap(incoming_);
+        }
+        for (auto& [id, s] : sessions_) all.push_back(std::move(s));
+        sessions_.clear();
+        for (auto& s : all) end(*s);
+    }
+
+    // Start new sessions, process each session's queue with the given budget
+    // and reap the ones whose client disconnected. Call from the main thread.
+    // Returns true if every queue was drained.
+    bool process_queue(DispatchBudget budget = {}) {
+        std::vector<std::unique_ptr<Session>> fresh;
+        {
+            std::lock_guard<std::mutex> lock(incoming_mutex_);
+            fresh.swap(incoming_);
+        }
+        for (auto& s : fresh) {
+            s->conn = std::make_unique<Conn>(waker_, details::handle_source(s->handle),
+                                             details::handle_sink(s->handle));
+            if (setup_) setup_(*s->conn, s->id);
+            s->conn->start();
+            sessions_.emplace(s->id, std::move(s));
+        }
+        bool drained = true;
+        for (auto it = sessions_.begin(); it != sessions_.end();) {
+            Conn& conn = *it->second->conn;
+            drained = conn.process_queue(budget) && drained;
+            if (conn.is_running()) {
+                ++it;
+                continue;
+            }
+            SessionId id = it->first;
+            auto s = std::move(it->second);
+            it = sessions_.erase(it);
+            end(*s);
+            if (closed_) closed_(id);
+        }
+        return drained;
+    }
+
+    // The Conn of a live session, or nullptr. Valid on the main thread until
+    // the next process_queue().
+    Conn* session(SessionId id) const {
+        auto it = sessions_.find(id);
+        return it == sessions_.end() ? nullptr : it->second->conn.get();
+    }
+
+    size_t session_count() const { return sessions_.size(); }
+
+    // Earliest request deadline of any session, see Conn::next_deadline().
+    std::optional<std::chrono::steady_clock::time_point> next_deadline() const {
+        std::optional<std::chrono::steady_clock::time_point> next;
+        for (const auto& [id, s] : sessions_) {
+            auto d = s->conn->next_deadline();
+            if (d && (!next || *d < *next)) next = d;
+        }
+        return next;
+    }
+
+    // Disconnect a client. The session is reaped, and Closed called, by a
+    // later process_queue().
+    void close_session(SessionId id) {
+        auto it = sessions_.find(id);
+        if (it != sessions_.end()) details::shutdown_handle(it->second->handle);
+    }
+
+private:
+    struct Session {
+        SessionId id = 0;
+        details::NativeHandle handle = details::kInvalidHandle;
+        std::unique_ptr<Conn> conn;
+    };
+
+    Conn::Waker waker_;
+    Setup setup_;
+    Closed closed_;
+    std::string endpoint_;
+    std::thread accept_thread_;
+    std::atomic<bool> stopping_{ false };
+#ifdef _WIN32
+    std::shared_ptr<void> pipe_security_; // For every pipe instance.
+#else
+    int listen_fd_ = -1;
+#endif
+    SessionId next_id_ = 1; // Accept thread only.
+
+    std::mutex incoming_mutex_;
+    std::vector<std::unique_ptr<Session>> incoming_; // Accepted, not yet started.
+    std::map<SessionId, std::unique_ptr<Session>> sessions_; // Main thread only.
+
+    void end(Session& s) {
+        details::shutdown_handle(s.handle);
+        if (s.conn) s.conn->stop();
+        s.conn.reset();
+        details::close_handle(s.handle);
+    }
+
+    void accepted(details::NativeHandle h) {
+        auto s = std::make_unique<Session>();
+        s->id = next_id_++;
+        s->handle = h;
+        {
+            std::lock_guard<std::mutex> lock(incoming_mutex_);
+            incoming_.push_back(std::move(s));
+        }
+        if (waker_) waker_();
+    }
+
+#ifdef _WIN32
+    HANDLE create_pipe(bool first) {
+        if (!pipe_security_) return INVALID_HANDLE_VALUE;
+        SECURITY_ATTRIBUTES sa{ sizeof(sa), pipe_security_.get(), FALSE };
+        DWORD open_mode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0);
+        return CreateNamedPipeW(details::pipe_name(endpoint_).c_str(), open_mode,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            PIPE_UNLIMITED_INSTANCES, 64 * 1024, 64 * 1024, 0, &sa);
+    }
+
+    void accept_loop(HANDLE h) {
+        trace::set_thread_name("jsonrpc accept");
+        auto event = details::make_event();
+        while (h != INVALID_HANDLE_VALUE) {
+            OVERLAPPED ov{};
+            ov.hEvent = event.get();
+            DWORD n = 0;
+            bool ok = ConnectNamedPipe(h, &ov) != FALSE;
+            if (!ok) {
+                DWORD err = GetLastError();
+                ok = err == ERROR_PIPE_CONNECTED ||
+                     (err == ERROR_IO_PENDING && GetOverlappedResult(h, &ov, &n, TRUE));
+            }
+            if (stopping_) {
+                CloseHandle(h);
+                return;
+            }
+            if (ok) {
+                accepted(h);
+            } else {
+                CloseHandle(h);
+            }
+            h = create_pipe(false);
+        }
+    }
+#else
+    void accept_loop() {
+        trace::set_thread_name("jsonrpc accept");
+        while (!stopping_) {
+            int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return; // Shut down by stop().
+            }
+            if (stopping_) {
+                ::close(fd);
+                return;
+            }
+            accepted(fd);
+        }
+    }
+#endif
+};
+
+} // namespace jsonrpc
@@ -4,7 +4,52 @@
 #define WM_JSONRPC_MESSAGE (WM_USER + 114514)
 std::unique_ptr<AppContext> g_app;
 
-int main() {
+// Work done per WM_JSONRPC_MESSAGE. When a burst exceeds it, process_queue
+// re-posts the message, so WebView2 events queued meanwhile get their turn.
+static constexpr jsonrpc::DispatchBudget kDispatchBudget{
+    .max_messages = 256,
+    .max_time = std::chrono::milliseconds(8),
+};
+
+// --trace <file>: record a Chrome trace from startup and write it on exit.
+// --record <file>: log the JSON-RPC traffic, see tools/jsonrpc_replay.cpp.
+// --listen <pipe>: also serve clients on a named pipe, e.g. \\.\pipe\wv2.
+static std::string parse_path_option(int argc, char* argv[], std::string_view name) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string_view(argv[i]) == name) {
+            return argv[i + 1];
+        }
+    }
+    return {};
+}
+
+// Arm a thread timer for the earliest deadline of a request sent to any
+// client, so process_queue() times it out even if nothing else arrives.
+// A request that moves the deadline earlier wakes the loop to re-arm it.
+static void arm_deadline_timer(UINT_PTR& timer) {
+    auto next = g_app->server.next_deadline();
+    auto other = g_app->listener.next_deadline();
+    if (!next || (other && *other < *next)) {
+        next = other;
+    }
+    if (timer) {
+        KillTimer(nullptr, timer);
+        timer = 0;
+    }
+    if (next) {
+        auto ms = std::chrono::ceil<std::chrono::milliseconds>(*next - std::chrono::steady_clock::now()).count();
+        timer = SetTimer(nullptr, 0, (UINT)std::clamp<long long>(ms, USER_TIMER_MINIMUM, USER_TIMER_MAXIMUM), nullptr);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::string trace_path = parse_path_option(argc, argv, "--trace");
+    std::string record_path = parse_path_option(argc, argv, "--record");
+    std::string listen_path = parse_path_option(argc, argv, "--listen");
+    jsonrpc::trace::set_thread_name("main");
+    if (!trace_path.empty()) {
+        jsonrpc::trace::start();
+    }
     // Initialize COM for the main thread
     (void)CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
 
@@ -21,15 +66,33 @@ int main() {
     } else {
 
     }
-    webview_init();
+    webview_init(g_app->server, kStdioSession);
+    if (!record_path.empty()) {
+        g_app->server.start_recording(record_path);
+    }
     // Start the JSON-RPC server
     g_app->server.start();
+    if (!listen_path.empty() && !g_app->listener.listen(listen_path)) {
+        std::cerr << "[wv2] Cannot listen on " << listen_path << std::endl;
+    }
+    // Once our own Emacs is gone, keep running while other clients remain.
+    bool stdio_released = false;
+    UINT_PTR deadline_timer = 0;
     MSG msg;
     while (GetMessage(&msg, nullptr, 0, 0)) {
-        if (msg.message == WM_JSONRPC_MESSAGE) {
-            g_app->server.process_queue();
+        bool deadline = msg.message == WM_TIMER && msg.hwnd == nullptr && msg.wParam == deadline_timer;
+        if (msg.message == WM_JSONRPC_MESSAGE || deadline) {
+            g_app->server.process_queue(kDispatchBudget);
+            g_app->listener.process_queue(kDispatchBudget);
+            arm_deadline_timer(deadline_timer);
             if (!g_app->server.is_running()) {
-                break;
+                if (g_app->listener.session_count() == 0) {
+                    break;
+                }
+                if (!stdio_released) {
+                    webview_release_session(kStdioSession);
+                    stdio_released = true;
+                }
             }
         } else {
             TranslateMessage(&msg);
@@ -40,6 +103,10 @@ int main() {
     if (hIn != INVALID_HANDLE_VALUE) {
         CancelIoEx(hIn, nullptr); // Forcefully abort pending I/O on the reader thread
     }
+    // Method names in the trace belong to the connection, write it first.
+    if (!trace_path.empty()) {
+        jsonrpc::trace::write(trace_path);
+    }
     // Free resources before COM uninitialize.
     g_app.reset();
     CoUninitialize();
@@ -0,0 +1,216 @@
+// Binary log of JSON-RPC traffic, for replaying real sessions as
+// benchmarks (see tools/jsonrpc_replay.cpp).
+//
+// File layout: the 8-byte magic "WV2RLOG1", then records of
+//     u8      kind     (Kind, plus the frame encoding in the high nibble)
+//     varint  delta    (microseconds since the previous record or the
+//                       opening of the log, monotonic)
+//     varint  length
+//     bytes   data
+// In records hold one frame body as received. Out records hold bytes as
+// written to the pipe: one or more complete frames, headers included.
+//
+// Appending is a copy into a buffer under a mutex; the buffer goes to the
+// file once it grows past kFlushSize, on the reader or writer thread that
+// filled it, never on the main thread.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace jsonrpc {
+namespace record {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr char kMagic[8] = { 'W', 'V', '2', 'R', 'L', 'O', 'G', '1' };
+
+enum class Kind : uint8_t {
+    In = 0,  // Frame body from the peer.
+    Out = 1, // Bytes written to the peer.
+};
+
+namespace details {
+
+// fopen, minus the MSVC deprecation error.
+inline std::FILE* open_file(const std::string& path, const char* mode) {
+#ifdef _WIN32
+    std::FILE* f = nullptr;
+    return fopen_s(&f, path.c_str(), mode) == 0 ? f : nullptr;
+#else
+    return std::fopen(path.c_str(), mode);
+#endif
+}
+
+// Size of an open file in bytes, -1 if unknown. Leaves the position at 0.
+inline int64_t file_size(std::FILE* f) {
+#ifdef _WIN32
+    int64_t size = _fseeki64(f, 0, SEEK_END) == 0 ? _ftelli64(f) : -1;
+    _fseeki64(f, 0, SEEK_SET);
+#else
+    int64_t size = fseeko(f, 0, SEEK_END) == 0 ? (int64_t)ftello(f) : -1;
+    fseeko(f, 0, SEEK_SET);
+#endif
+    return size;
+}
+
+} // namespace details
+
+struct Record {
+    Kind kind = Kind::In;
+    uint8_t encoding = 0; // jsonrpc::Encoding of an In record.
+    int64_t ts = 0;       // Microseconds since the log was opened.
+    std::string data;
+};
+
+class Recorder {
+public:
+    static constexpr size_t kFlushSize = 256 * 1024;
+
+    Recorder() = default;
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+    ~Recorder() { close(); }
+
+    // Start a new log at path, replacing any open one. Returns false if the
+    // file cannot be created.
+    bool open(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        close_locked();
+        file_ = details::open_file(path, "wb");
+        if (!file_) return false;
+        buf_.assign(kMagic, sizeof(kMagic));
+        last_ = Clock::now();
+        open_.store(true, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Flush and close the log. Returns false if writing failed at any point.
+    bool close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return close_locked();
+    }
+
+    bool is_open() const { return open_.load(std::memory_order_relaxed); }
+
+    void append(Kind kind, uint8_t encoding, std::string_view data) {
+        if (!is_open()) return;
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!file_) return;
+        auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - last_).count();
+        last_ = now;
+        buf_.push_back((char)((uint8_t)kind | (uint8_t)(encoding << 4)));
+        put_varint(delta > 0 ? (uint64_t)delta : 0);
+        put_varint(data.size());
+        buf_.append(data);
+        if (buf_.size() >= kFlushSize) flush_locked();
+    }
+
+private:
+    std::mutex mutex_;
+    std::atomic<bool> open_{ false };
+    std::FILE* file_ = nullptr;
+    std::string buf_;
+    Clock::time_point last_;
+    bool failed_ = false;
+
+    void put_varint(uint64_t v) {
+        while (v >= 0x80) {
+            buf_.push_back((char)(v | 0x80));
+            v >>= 7;
+        }
+        buf_.push_back((char)v);
+    }
+
+    void flush_locked() {
+        if (!buf_.empty() && std::fwrite(buf_.data(), 1, buf_.size(), file_) != buf_.size()) {
+            failed_ = true;
+        }
+        buf_.clear();
+    }
+
+    bool close_locked() {
+        open_.store(false, std::memory_order_relaxed);
+        if (!file_) return true;
+        flush_locked();
+        bool ok = !failed_ && std::fclose(file_) == 0;
+        file_ = nullptr;
+        failed_ = false;
+        return ok;
+    }
+};
+
+// Sequential reader of a log written by Recorder.
+class LogReader {
+public:
+    LogReader() = default;
+    LogReader(const LogReader&) = delete;
+    LogReader& operator=(const LogReader&) = delete;
+    ~LogReader() {
+        if (file_) std::fclose(file_);
+    }
+
+    // Returns false if the file is missing or is not a log.
+    bool open(const std::string& path) {
+        file_ = details::open_file(path, "rb");
+        if (!file_) return false;
+        int64_t size = details::file_size(file_);
+        char magic[sizeof(kMagic)];
+        if (size < (int64_t)sizeof(magic) || std::fread(magic, 1, sizeof(magic), file_) != sizeof(magic) ||
+            std::memcmp(magic, kMagic, sizeof(magic)) != 0) {
+            return false;
+        }
+        left_ = (uint64_t)size - sizeof(magic);
+        return true;
+    }
+
+    // Read the next record. Returns false at the end of the log, or at a
+    // record cut short by a crash or whose length runs past the file.
+    bool next(Record& r) {
+        int kind = get_byte();
+        uint64_t delta = 0, length = 0;
+        if (kind == EOF || !get_varint(delta) || !get_varint(length)) return false;
+        // Checked before allocating: a corrupt length must not size the buffer.
+        if (length > left_) return false;
+        r.kind = (Kind)(kind & 0x0F);
+        r.encoding = (uint8_t)(kind >> 4);
+        ts_ += (int64_t)delta;
+        r.ts = ts_;
+        r.data.resize(length);
+        left_ -= length;
+        return std::fread(r.data.data(), 1, length, file_) == length;
+    }
+
+private:
+    std::FILE* file_ = nullptr;
+    int64_t ts_ = 0;
+    uint64_t left_ = 0; // Bytes of the file not read yet.
+
+    int get_byte() {
+        if (left_ == 0) return EOF;
+        left_--;
+        return std::fgetc(file_);
+    }
+
+    bool get_varint(uint64_t& v) {
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int c = get_byte();
+            if (c == EOF) return false;
+            v |= (uint64_t)(c & 0x7F) << shift;
+            if (!(c & 0x80)) return true;
+        }
+        return false;
+    }
+};
+
+} // namespace record
+} // namespace jsonrpc
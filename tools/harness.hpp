@@ -0,0 +1,85 @@
+// In-memory stand-ins for the process pipes and the Win32 message loop,
+// shared by the tools in this directory.
+
+#pragma once
+
+#include "jsonrpc.hpp"
+
+#include <condition_variable>
+#include <mutex>
+#include <streambuf>
+#include <string>
+
+// Blocking in-memory pipe: one side writes through an ostream, the other
+// reads through an istream and waits for data, like a process pipe.
+class Pipe : public std::streambuf {
+public:
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        cv_.notify_all();
+    }
+
+protected:
+    int_type underflow() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return !data_.empty() || closed_; });
+        if (data_.empty()) return traits_type::eof();
+        chunk_.swap(data_);
+        data_.clear();
+        setg(chunk_.data(), chunk_.data(), chunk_.data() + chunk_.size());
+        return traits_type::to_int_type(chunk_[0]);
+    }
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        data_.append(s, (size_t)n);
+        cv_.notify_all();
+        return n;
+    }
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof()) {
+            char ch = traits_type::to_char_type(c);
+            xsputn(&ch, 1);
+        }
+        return c;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::string data_;
+    std::string chunk_;
+    bool closed_ = false;
+};
+
+// Main-loop stand-in: process_queue() whenever the waker fires.
+struct EventLoop {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool pending = false;
+
+    jsonrpc::Conn::Waker waker() {
+        return [this] {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = true;
+            cv.notify_one();
+        };
+    }
+
+    // Run until done() holds or the connection stops.
+    template <typename Done>
+    void run(jsonrpc::Conn& conn, Done done) {
+        while (!done()) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait_for(lock, std::chrono::milliseconds(10), [this] { return pending; });
+                pending = false;
+            }
+            conn.process_queue();
+            if (!conn.is_running() && conn.lane_stats(jsonrpc::Lane::Interactive).queued == 0 &&
+                conn.lane_stats(jsonrpc::Lane::Bulk).queued == 0) {
+                break;
+            }
+        }
+    }
+};
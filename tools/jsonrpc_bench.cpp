@@ -0,0 +1,851 @@
+// Benchmarks for the JSON-RPC core (jsonrpc.hpp), driven entirely in memory
+// so they run anywhere the header builds, Linux included:
+//
+//     g++ -std=c++20 -O2 -I.. jsonrpc_bench.cpp -pthread -o jsonrpc_bench
+//     ./jsonrpc_bench [--quick]
+//
+// Traffic is modelled on what emacs-webview2.el sends, at several payload
+// sizes. Every result is printed as one JSON object per line, e.g.
+//     {"bench":"frame_parse","size":1024,"messages":...,"msgs_per_sec":...}
+// so runs can be diffed or collected release to release.
+//
+// "heap_allocs_per_msg" counts calls to operator new; "arena_allocs_per_msg"
+// the json allocations served by the per-frame arena. Build with
+// -DJSONRPC_NO_ARENA to compare against plain nlohmann::json.
+
+#include "jsonrpc.hpp"
+#include "harness.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sstream>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using jsonrpc::json;
+using Clock = std::chrono::steady_clock;
+
+// Counting replacements of the global operator new/delete. GCC flags the
+// malloc/free pairing once they are inlined, wrongly.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+static std::atomic<uint64_t> g_news{ 0 };
+
+void* operator new(size_t n) {
+    g_news.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t n) { return operator new(n); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+bool g_quick = false;
+
+// Payload sizes to run at. 0 keeps the natural size of each message.
+const size_t kSizes[] = { 0, 1024, 64 * 1024, 1024 * 1024 };
+
+// Messages modelled on emacs-webview2.el. `payload` pads the string each
+// message carries (a URL, an echo argument) to about that many bytes.
+std::vector<json> emacs_mix(size_t payload) {
+    std::string url = "https://example.com/";
+    if (payload > url.size()) url.append(payload - url.size(), 'a');
+    json rect1 = { 0, 0, 800, 600 };
+    json rect2 = { 800, 0, 1600, 600 };
+    auto notify = [](const char* method, json params) {
+        return json{ {"jsonrpc", "2.0"}, {"method", method}, {"params", std::move(params)} };
+    };
+    auto request = [](const char* method, json params) {
+        return json{ {"jsonrpc", "2.0"}, {"id", 0}, {"method", method}, {"params", std::move(params)} };
+    };
+    json ui_batch = { {1, nullptr, rect1, nullptr}, {2, 1, rect2, 131234} };
+    return {
+        notify("wv/sync-ui-batch", ui_batch),
+        notify("wv/resize", { 1, rect1 }),
+        notify("wv/set-visible", { 2, true }),
+        notify("wv/navigate", { 1, url }),
+        request("wv/get-title", { 1 }),
+        request("echo", { url }),
+        notify("wv/focus", { 1 }),
+        request("wv/ssync-ui-batch", ui_batch),
+    };
+}
+
+std::string frame(const std::string& body) {
+    return "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+// Repeat the mix until about `target` bytes or `max` messages, numbering
+// requests. The mix is always included at least once.
+std::string build_stream(size_t payload, size_t target, size_t max, size_t& messages) {
+    auto mix = emacs_mix(payload);
+    std::string out;
+    messages = 0;
+    int id = 1;
+    do {
+        for (auto m : mix) {
+            if (m.contains("id")) m["id"] = id++;
+            out += frame(m.dump());
+            messages++;
+        }
+    } while (out.size() < target && messages < max);
+    return out;
+}
+
+size_t scaled(size_t n) { return g_quick ? (std::max)(n / 10, size_t(1)) : n; }
+
+void report(const char* bench, size_t size, size_t messages, size_t bytes, double seconds, json extra = json::object()) {
+    json r = {
+        {"bench", bench}, {"size", size}, {"messages", messages}, {"bytes", bytes},
+        {"seconds", seconds},
+        {"msgs_per_sec", seconds > 0 ? messages / seconds : 0.0},
+        {"mb_per_sec", seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0.0},
+    };
+    r.update(extra);
+    std::printf("%s\n", r.dump().c_str());
+    std::fflush(stdout);
+}
+
+double since(Clock::time_point t) {
+    return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+// Allocation counts over a timed region, per message.
+class AllocCounter {
+public:
+    AllocCounter() : news_(g_news.load()), arena_(arena_allocs()) {}
+
+    json per_message(size_t messages) const {
+        double n = messages ? (double)messages : 1.0;
+        return {
+            {"heap_allocs_per_msg", (g_news.load() - news_) / n},
+            {"arena_allocs_per_msg", (arena_allocs() - arena_) / n},
+        };
+    }
+
+private:
+    uint64_t news_;
+    uint64_t arena_;
+
+    static uint64_t arena_allocs() {
+#ifndef JSONRPC_NO_ARENA
+        return jsonrpc::alloc_stats().arena_allocs;
+#else
+        return 0;
+#endif
+    }
+};
+
+// Handlers with the shape of the webview_init ones, doing no real work.
+void register_methods(jsonrpc::Conn& conn, std::vector<jsonrpc::Context>* async_replies = nullptr) {
+    auto nop = [](const json&) {};
+    for (const char* n : { "wv/sync-ui-batch", "wv/resize", "wv/set-visible", "wv/navigate", "wv/focus" }) {
+        conn.register_notification(n, nop);
+    }
+    conn.register_method("wv/ssync-ui-batch", [](const json&) -> json { return true; });
+    conn.register_method("echo", [](const json& p) -> json { return p; });
+    if (async_replies) {
+        // Reply later, like a COM completion handler would.
+        conn.register_async_method("wv/get-title", [async_replies](jsonrpc::Context ctx, const json&) {
+            async_replies->push_back(std::move(ctx));
+        });
+    } else {
+        conn.register_method("wv/get-title", [](const json&) -> json { return "Example Domain"; });
+    }
+}
+
+// Framing and parse throughput: FrameReader + MessageDecoder over memory.
+void bench_frame_parse() {
+    for (size_t size : kSizes) {
+        size_t messages = 0;
+        std::string stream = build_stream(size, scaled(64 << 20), scaled(200000), messages);
+        std::istringstream in(stream);
+        jsonrpc::FrameReader reader(jsonrpc::istream_source(in), SIZE_MAX);
+        jsonrpc::MessageDecoder decoder;
+        jsonrpc::DecodedFrame frame;
+        size_t decoded = 0;
+        AllocCounter allocs;
+        auto start = Clock::now();
+        while (reader.next_header() == jsonrpc::FrameReader::Status::Ok) {
+            if (reader.content_length() <= reader.chunk_size()) {
+                std::string_view body;
+                reader.read_body(body);
+                decoder.decode(body, frame);
+            } else {
+                decoder.decode(reader.body_begin(), reader.body_end(), frame);
+                reader.skip_body();
+            }
+            decoded += frame.messages.size();
+        }
+        double seconds = since(start);
+        report("frame_parse", size, decoded, stream.size(), seconds, allocs.per_message(decoded));
+    }
+}
+
+// Decoding frame bodies already in memory: the SAX MessageDecoder, or the
+// DOM path it replaced, json::parse followed by Parser::parse.
+void bench_decode(bool sax) {
+    for (size_t size : kSizes) {
+        std::vector<std::string> bodies;
+        size_t bytes = 0;
+        for (auto& m : emacs_mix(size)) {
+            bodies.push_back(m.dump());
+            bytes += bodies.back().size();
+        }
+        size_t rounds = (std::max)(scaled(64 << 20) / bytes, size_t(1));
+        rounds = (std::min)(rounds, scaled(200000) / bodies.size());
+        size_t n = rounds * bodies.size();
+        jsonrpc::MessageDecoder decoder;
+        jsonrpc::IncomingMessage msg;
+        size_t ok = 0;
+        AllocCounter allocs;
+        auto start = Clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (const auto& body : bodies) {
+                if (sax) {
+                    if (!decoder.decode(body, msg).ok()) continue;
+                } else {
+                    msg = jsonrpc::Parser::parse(json::parse(body));
+                }
+                ok += std::holds_alternative<jsonrpc::Request>(msg);
+            }
+        }
+        double seconds = since(start);
+        if (ok != n) std::abort();
+        report(sax ? "decode_sax" : "decode_dom", size, n, rounds * bytes, seconds, allocs.per_message(n));
+    }
+}
+
+// What values kept past their frame cost: one params in 64 is kept to the
+// end, moved out of the decoded message (holding its arena) or copied (to
+// the heap). "held_bytes" is the arena memory the kept values add.
+void bench_arena_retention(bool copy) {
+    size_t messages = 0;
+    std::string stream = build_stream(0, SIZE_MAX, scaled(200000), messages);
+    std::istringstream in(stream);
+    jsonrpc::FrameReader reader(jsonrpc::istream_source(in), SIZE_MAX);
+    jsonrpc::MessageDecoder decoder;
+    jsonrpc::IncomingMessage msg;
+    std::vector<json> kept;
+    std::string_view body;
+    size_t decoded = 0;
+#ifndef JSONRPC_NO_ARENA
+    uint64_t held = jsonrpc::alloc_stats().held_bytes;
+#endif
+    AllocCounter allocs;
+    auto start = Clock::now();
+    while (reader.next(body) == jsonrpc::FrameReader::Status::Ok) {
+        if (!decoder.decode(body, msg).ok()) continue;
+        if (decoded++ % 64 == 0) {
+            auto& params = std::get<jsonrpc::Request>(msg).params;
+            kept.push_back(copy ? json(params) : std::move(params));
+        }
+    }
+    double seconds = since(start);
+    json extra = allocs.per_message(decoded);
+    extra["kept"] = kept.size();
+#ifndef JSONRPC_NO_ARENA
+    extra["held_bytes"] = (int64_t)(jsonrpc::alloc_stats().held_bytes - held);
+#endif
+    report(copy ? "retain_copied" : "retain_moved", 0, decoded, stream.size(), seconds, extra);
+}
+
+// The message mix in each wire encoding: FrameEncoder frames, then
+// MessageDecoder over their bodies, with the bytes each one puts on the
+// pipe, headers included.
+void bench_encoding(jsonrpc::Encoding encoding) {
+    for (size_t size : kSizes) {
+        std::vector<jsonrpc::Request> mix;
+        for (auto& m : emacs_mix(size)) {
+            mix.push_back(m.get<jsonrpc::Request>());
+        }
+        size_t rounds = scaled(size >= 64 * 1024 ? 250 : 25000);
+        size_t n = rounds * mix.size();
+        jsonrpc::FrameEncoder enc;
+        enc.set_encoding(encoding);
+        std::vector<std::string> bodies;
+        size_t wire = 0;
+        auto start = Clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (const auto& m : mix) {
+                auto f = enc.request(m.id, m.method, m.params);
+                wire += f.size();
+                if (r == 0) bodies.emplace_back(f.substr(f.find("\r\n\r\n") + 4));
+            }
+        }
+        double encode_seconds = since(start);
+        jsonrpc::MessageDecoder decoder;
+        jsonrpc::IncomingMessage msg;
+        size_t ok = 0;
+        start = Clock::now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (const auto& body : bodies) {
+                ok += decoder.decode(body, msg, encoding).ok();
+            }
+        }
+        double decode_seconds = since(start);
+        if (ok != n) std::abort();
+        const char* name = encoding == jsonrpc::Encoding::Cbor ? "encoding_cbor"
+                         : encoding == jsonrpc::Encoding::MsgPack ? "encoding_msgpack" : "encoding_json";
+        report(name, size, n, wire, encode_seconds + decode_seconds,
+               { {"wire_bytes_per_msg", wire / n},
+                 {"encode_msgs_per_sec", encode_seconds > 0 ? n / encode_seconds : 0.0},
+                 {"decode_msgs_per_sec", decode_seconds > 0 ? n / decode_seconds : 0.0} });
+    }
+}
+
+// An OS pipe, so reads return whatever the writer has flushed so far, as
+// they do on the manager's stdin.
+struct OsPipe {
+    int fds[2] = { -1, -1 };
+
+    OsPipe() {
+#ifdef _WIN32
+        if (_pipe(fds, 64 * 1024, _O_BINARY) != 0) std::abort();
+#else
+        if (::pipe(fds) != 0) std::abort();
+#endif
+    }
+    ~OsPipe() {
+        close_write();
+        if (fds[0] >= 0) close_fd(fds[0]);
+    }
+
+    size_t read(char* buf, size_t len) {
+#ifdef _WIN32
+        int n = _read(fds[0], buf, (unsigned int)(std::min)(len, (size_t)INT_MAX));
+#else
+        ssize_t n = ::read(fds[0], buf, len);
+#endif
+        return n > 0 ? (size_t)n : 0;
+    }
+
+    void write_all(std::string_view data) {
+        while (!data.empty()) {
+#ifdef _WIN32
+            int n = _write(fds[1], data.data(), (unsigned int)(std::min)(data.size(), (size_t)INT_MAX));
+#else
+            ssize_t n = ::write(fds[1], data.data(), data.size());
+#endif
+            if (n <= 0) std::abort();
+            data.remove_prefix((size_t)n);
+        }
+    }
+
+    void close_write() {
+        if (fds[1] >= 0) close_fd(fds[1]);
+        fds[1] = -1;
+    }
+
+private:
+    static void close_fd(int fd) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        ::close(fd);
+#endif
+    }
+};
+
+// std::istream over an OsPipe, buffered like std::cin.
+class PipeBuf : public std::streambuf {
+public:
+    explicit PipeBuf(OsPipe& pipe) : pipe_(pipe) {}
+
+protected:
+    int_type underflow() override {
+        size_t n = pipe_.read(buf_, sizeof(buf_));
+        if (n == 0) return traits_type::eof();
+        setg(buf_, buf_, buf_ + n);
+        return traits_type::to_int_type(buf_[0]);
+    }
+
+private:
+    OsPipe& pipe_;
+    char buf_[4096];
+};
+
+// The read loop Conn had before FrameReader: headers through std::getline,
+// each body into a fresh std::vector<char>, then a DOM parse.
+size_t read_frames_getline(std::istream& in) {
+    size_t parsed = 0;
+    std::string line;
+    while (true) {
+        size_t content_length = 0;
+        while (true) {
+            if (!std::getline(in, line)) return parsed;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty()) break;
+            if (line.starts_with("Content-Length:")) {
+                content_length = std::stoull(line.substr(line.find(':') + 1));
+            }
+        }
+        std::vector<char> buffer(content_length);
+        in.read(buffer.data(), (std::streamsize)content_length);
+        if (in.gcount() != (std::streamsize)content_length) return parsed;
+        auto msg = jsonrpc::Parser::parse(json::parse(buffer.begin(), buffer.end()));
+        if (std::holds_alternative<jsonrpc::Request>(msg)) parsed++;
+    }
+}
+
+// 100k small wv/sync-ui-batch notifications written into an OS pipe by
+// another thread and read back by FrameReader + MessageDecoder, or by the
+// former getline loop.
+void bench_pipe_frames(bool getline) {
+    size_t n = scaled(100000);
+    json batch = { {1, nullptr, {0, 0, 800, 600}, nullptr}, {2, 1, {800, 0, 1600, 600}, 131234} };
+    std::string stream;
+    for (size_t i = 0; i < n; i++) {
+        stream += frame(json{ {"jsonrpc", "2.0"}, {"method", "wv/sync-ui-batch"}, {"params", batch} }.dump());
+    }
+    OsPipe pipe;
+    size_t parsed = 0;
+    AllocCounter allocs;
+    auto start = Clock::now();
+    std::thread writer([&] {
+        // Chunks of a few frames, as Emacs flushes them.
+        for (size_t off = 0; off < stream.size(); off += 1024) {
+            pipe.write_all(std::string_view(stream).substr(off, 1024));
+        }
+        pipe.close_write();
+    });
+    if (getline) {
+        PipeBuf buf(pipe);
+        std::istream in(&buf);
+        parsed = read_frames_getline(in);
+    } else {
+        jsonrpc::FrameReader reader([&pipe](char* buf, size_t len) { return pipe.read(buf, len); }, SIZE_MAX);
+        jsonrpc::MessageDecoder decoder;
+        jsonrpc::IncomingMessage msg;
+        std::string_view body;
+        while (reader.next(body) == jsonrpc::FrameReader::Status::Ok) {
+            if (decoder.decode(body, msg).ok() && std::holds_alternative<jsonrpc::Request>(msg)) parsed++;
+        }
+    }
+    double seconds = since(start);
+    writer.join();
+    if (parsed != n) std::abort();
+    report(getline ? "pipe_frames_getline" : "pipe_frames_reader", 0, n, stream.size(), seconds, allocs.per_message(n));
+}
+
+// Stress of the inbox queue across two threads: a producer pushes a
+// sequence through a small SpscQueue, so it is often full or empty, and the
+// consumer checks that every item arrives once and in order. Aborts on a
+// lost, repeated or reordered item.
+void bench_spsc() {
+    for (size_t capacity : { 2, 64, 1024 }) {
+        // A queue of two hands over at almost every item, which is slow.
+        size_t n = scaled(capacity < 64 ? 2000000 : 20000000);
+        jsonrpc::SpscQueue<uint64_t> queue(capacity);
+        uint64_t full = 0, empty = 0;
+        auto start = Clock::now();
+        std::thread producer([&] {
+            for (uint64_t i = 0; i < n; i++) {
+                uint64_t v = i;
+                while (!queue.try_push(v)) {
+                    full++;
+                    std::this_thread::yield();
+                }
+            }
+        });
+        for (uint64_t expected = 0; expected < n; expected++) {
+            uint64_t v;
+            while (!queue.try_pop(v)) {
+                empty++;
+                std::this_thread::yield();
+            }
+            if (v != expected) {
+                std::fprintf(stderr, "spsc: expected %llu, got %llu\n", (unsigned long long)expected, (unsigned long long)v);
+                std::abort();
+            }
+        }
+        producer.join();
+        double seconds = since(start);
+        uint64_t v;
+        if (queue.try_pop(v) || queue.size() != 0) std::abort();
+        report("spsc_stress", capacity, n, n * sizeof(uint64_t), seconds,
+               { {"full_waits", full}, {"empty_waits", empty} });
+    }
+}
+
+// Full inbound path: reader thread, queue, dispatch and reply, for sync
+// handlers or async ones answered after the handler returns.
+void bench_dispatch(bool async) {
+    for (size_t size : kSizes) {
+        size_t messages = 0;
+        std::string stream = build_stream(size, scaled(32 << 20), scaled(100000), messages);
+        std::istringstream in(stream);
+        std::ostringstream out, err;
+        EventLoop loop;
+        jsonrpc::Conn conn(loop.waker(), in, out, err, SIZE_MAX);
+        std::vector<jsonrpc::Context> pending;
+        register_methods(conn, async ? &pending : nullptr);
+        AllocCounter allocs;
+        auto start = Clock::now();
+        conn.start();
+        loop.run(conn, [&] {
+            for (auto& ctx : pending) ctx.reply("Example Domain");
+            pending.clear();
+            return false;
+        });
+        conn.stop(); // Drains the replies.
+        double seconds = since(start);
+        json extra = allocs.per_message(messages);
+        extra["replies_bytes"] = out.str().size();
+        report(async ? "dispatch_async" : "dispatch_sync", size, messages, stream.size(), seconds, extra);
+    }
+}
+
+// Outbound notifications as the manager sends them: input/event and
+// wv/title-changed, serialized and written by the writer thread.
+void bench_notify() {
+    for (size_t size : kSizes) {
+        std::string title = "Example Domain";
+        if (size > title.size()) title.append(size - title.size(), 't');
+        size_t n = scaled(size >= 64 * 1024 ? 2000 : 200000);
+        std::istringstream in;
+        std::ostringstream out, err;
+        jsonrpc::Conn conn([] {}, in, out, err);
+        conn.start();
+        auto start = Clock::now();
+        for (size_t i = 0; i < n; i++) {
+            if (i % 2) {
+                conn.send_notification("input/event", { {"id", 1}, {"key", 134217825} });
+            } else {
+                conn.send_notification("wv/title-changed", { {"id", 1}, {"title", title} });
+            }
+        }
+        conn.stop();
+        report("notify_serialize", size, n, out.str().size(), since(start));
+    }
+}
+
+// Serializing the same notifications alone, without Conn: FrameEncoder
+// writing the envelope straight into its buffer, or the former path of a
+// json envelope, dump() and a Content-Length header prepended to the body.
+void bench_encode(bool encoder) {
+    for (size_t size : kSizes) {
+        std::string title = "Example Domain";
+        if (size > title.size()) title.append(size - title.size(), 't');
+        size_t n = scaled(size >= 64 * 1024 ? 2000 : 200000);
+        const json input = { {"id", 1}, {"key", 134217825} };
+        const json changed = { {"id", 1}, {"title", title} };
+        jsonrpc::FrameEncoder enc;
+        size_t bytes = 0;
+        AllocCounter allocs;
+        auto start = Clock::now();
+        for (size_t i = 0; i < n; i++) {
+            const char* method = i % 2 ? "input/event" : "wv/title-changed";
+            const json& params = i % 2 ? input : changed;
+            if (encoder) {
+                bytes += enc.request(std::nullopt, method, params).size();
+            } else {
+                json j = { {"jsonrpc", "2.0"}, {"method", method}, {"params", params} };
+                bytes += frame(j.dump()).size();
+            }
+        }
+        double seconds = since(start);
+        report(encoder ? "encode_frame_encoder" : "encode_json_dump", size, n, bytes, seconds, allocs.per_message(n));
+    }
+}
+
+// Round trip of send_request through a peer that echoes every request
+// back as a response, one request in flight at a time.
+void bench_round_trip() {
+    for (size_t size : kSizes) {
+        std::string arg(size, 'r');
+        size_t n = scaled(size >= 64 * 1024 ? 200 : 5000);
+        Pipe to_peer, to_conn;
+        std::istream conn_in(&to_conn), peer_in(&to_peer);
+        std::ostream conn_out(&to_peer), peer_out(&to_conn);
+        std::ostringstream err;
+        EventLoop loop;
+        jsonrpc::Conn conn(loop.waker(), conn_in, conn_out, err, SIZE_MAX);
+        conn.start();
+
+        std::thread peer([&] {
+            jsonrpc::FrameReader reader(jsonrpc::istream_source(peer_in), SIZE_MAX);
+            jsonrpc::MessageDecoder decoder;
+            jsonrpc::FrameEncoder encoder;
+            std::string_view body;
+            while (reader.next(body) == jsonrpc::FrameReader::Status::Ok) {
+                jsonrpc::IncomingMessage msg;
+                if (!decoder.decode(body, msg).ok()) continue;
+                if (auto req = std::get_if<jsonrpc::Request>(&msg); req && req->id) {
+                    auto f = encoder.result(*req->id, req->params);
+                    peer_out.write(f.data(), (std::streamsize)f.size());
+                }
+            }
+        });
+
+        std::vector<double> latencies;
+        latencies.reserve(n);
+        size_t done = 0;
+        auto start = Clock::now();
+        for (size_t i = 0; i < n; i++) {
+            auto sent = Clock::now();
+            conn.send_request("echo", json::array({ arg }), [&](const jsonrpc::Response&) {
+                latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+                done++;
+            });
+            loop.run(conn, [&] { return done == i + 1; });
+        }
+        double seconds = since(start);
+        to_peer.close();
+        to_conn.close();
+        conn.stop();
+        peer.join();
+
+        std::sort(latencies.begin(), latencies.end());
+        auto pct = [&](double q) { return latencies.empty() ? 0.0 : latencies[(size_t)(q * (latencies.size() - 1))]; };
+        // Bytes are approximate: the argument each way plus framing.
+        report("round_trip", size, n, 2 * n * (size + 64), seconds,
+               { {"p50_us", pct(0.5)}, {"p99_us", pct(0.99)}, {"max_us", pct(1.0)} });
+    }
+}
+
+// Binary results of `size` bytes fetched one at a time by a peer, as
+// base64 in the JSON reply or through the shared blob region (read back
+// from the file and released, as emacs-webview2.el does).
+void bench_blob(bool shared) {
+    for (size_t size : { 64 * 1024, 1024 * 1024, 8 * 1024 * 1024 }) {
+        std::string payload(size, '\0');
+        for (size_t i = 0; i < size; i++) payload[i] = (char)(i * 2654435761u >> 24);
+        size_t n = scaled(size >= 1024 * 1024 ? 100 : 2000);
+        Pipe to_peer, to_conn;
+        std::istream conn_in(&to_conn), peer_in(&to_peer);
+        std::ostream conn_out(&to_peer), peer_out(&to_conn);
+        std::ostringstream err;
+        EventLoop loop;
+        jsonrpc::Conn conn(loop.waker(), conn_in, conn_out, err, SIZE_MAX);
+        conn.register_async_method("capture", [&](jsonrpc::Context ctx, const json&) {
+            ctx.reply_bytes(payload);
+        });
+        conn.start();
+
+        std::atomic<bool> done{ false };
+        size_t received = 0, wire = 0;
+        auto start = Clock::now();
+        std::thread peer([&] {
+            jsonrpc::FrameReader reader(jsonrpc::istream_source(peer_in), SIZE_MAX);
+            jsonrpc::MessageDecoder decoder;
+            jsonrpc::FrameEncoder encoder;
+            auto send = [&](std::optional<int> id, const char* method, const json& params) {
+                auto f = encoder.request(id, method, params);
+                peer_out.write(f.data(), (std::streamsize)f.size());
+            };
+            std::string_view body;
+            jsonrpc::IncomingMessage msg;
+            auto next_result = [&]() -> json {
+                while (reader.next(body) == jsonrpc::FrameReader::Status::Ok) {
+                    wire += body.size();
+                    if (!decoder.decode(body, msg).ok()) continue;
+                    if (auto resp = std::get_if<jsonrpc::Response>(&msg); resp && !resp->is_error()) {
+                        return std::get<json>(resp->content);
+                    }
+                }
+                return nullptr;
+            };
+            std::ifstream file;
+            if (shared) {
+                send(0, "$/blob/open", { {"size", 4 * size + (1 << 20)} });
+                file.open(next_result()["path"].get<std::string>(), std::ios::binary);
+            }
+            std::string bytes;
+            for (size_t i = 1; i <= n; i++) {
+                send((int)i, "capture", nullptr);
+                json r = next_result();
+                if (r.contains("blob")) {
+                    const json& b = r["blob"];
+                    bytes.resize(b["length"].get<size_t>());
+                    file.seekg(b["offset"].get<std::streamoff>());
+                    file.read(bytes.data(), (std::streamsize)bytes.size());
+                    send(std::nullopt, "$/blob/release", { {"handles", {b["handle"]}} });
+                } else {
+                    bytes = jsonrpc::blob::base64_decode(r["base64"].get<std::string>()).value_or("");
+                }
+                received += bytes.size();
+            }
+            done = true;
+            loop.waker()();
+        });
+        loop.run(conn, [&] { return done.load(); });
+        double seconds = since(start);
+        peer.join();
+        to_peer.close();
+        to_conn.close();
+        conn.stop();
+        report(shared ? "bytes_blob" : "bytes_base64", size, n, received, seconds,
+               { {"wire_bytes_per_msg", n ? wire / n : 0} });
+    }
+}
+
+// Stand-in for a WebView2 call with a completion handler: the handler runs
+// on a later turn of the main loop.
+class FakeAsync {
+public:
+    void start(int value, std::function<void(int)> done) {
+        queue_.emplace_back(value, std::move(done));
+    }
+
+    // Run the handlers queued so far and those they queue, until none is left.
+    void drain() {
+        while (!queue_.empty()) {
+            running_.swap(queue_);
+            for (auto& [value, done] : running_) done(value + 1);
+            running_.clear();
+        }
+    }
+
+private:
+    std::vector<std::pair<int, std::function<void(int)>>> queue_, running_;
+};
+
+struct FakeStep {
+    FakeAsync& api;
+    int value;
+    int result = 0;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        api.start(value, [this, h](int r) {
+            result = r;
+            h.resume();
+        });
+    }
+    int await_resume() const noexcept { return result; }
+};
+
+// A handler of three dependent async steps, like env/create followed by
+// wv/create, written as nested callbacks or as a Task. At most kWindow
+// requests are in flight, as when Emacs opens a few webviews at once.
+void bench_coroutine(bool task) {
+    constexpr size_t kWindow = 16;
+    size_t n = scaled(200000);
+    std::string stream;
+    for (size_t i = 1; i <= n; i++) {
+        stream += frame(json{ {"jsonrpc", "2.0"}, {"id", (int)i}, {"method", "steps"}, {"params", {1}} }.dump());
+    }
+    std::istringstream in(stream);
+    std::ostringstream out, err;
+    jsonrpc::Conn conn([] {}, in, out, err, SIZE_MAX);
+    FakeAsync api;
+    size_t replied = 0;
+    if (task) {
+        conn.register_async_method("steps", [&](jsonrpc::Context ctx, const json& params) -> jsonrpc::Task {
+            int x = co_await FakeStep{ api, params[0].get<int>() };
+            int y = co_await FakeStep{ api, x };
+            int z = co_await FakeStep{ api, y };
+            ctx.reply(x + y + z);
+            replied++;
+        });
+    } else {
+        conn.register_async_method("steps", [&](jsonrpc::Context ctx, const json& params) {
+            api.start(params[0].get<int>(), [&, ctx](int x) mutable {
+                api.start(x, [&, ctx, x](int y) mutable {
+                    api.start(y, [&, ctx, x, y](int z) mutable {
+                        ctx.reply(x + y + z);
+                        replied++;
+                    });
+                });
+            });
+        });
+    }
+    AllocCounter allocs;
+    auto start = Clock::now();
+    conn.start();
+    while (replied < n) {
+        if (conn.process_queue({ .max_messages = kWindow })) std::this_thread::yield();
+        api.drain();
+    }
+    double seconds = since(start);
+    conn.stop();
+    report(task ? "async_steps_task" : "async_steps_callback", 0, n, stream.size(), seconds, allocs.per_message(n));
+}
+
+// Decoding the params of wv/resize, [id, [left, top, right, bottom]], as
+// webview.cpp did by hand (indexing into params, or through the
+// std::vector<long> wv/create took its bounds in) and as the decoder of
+// register_method<Args...> does, type checks included.
+enum class ParamDecoding { Index, Vector, Typed };
+
+void bench_params(ParamDecoding how) {
+    struct Bounds { long left, top, right, bottom; }; // RECT
+    size_t n = scaled(5000000);
+    json params = json::parse("[42, [0, 0, 1280, 720]]");
+    int64_t sum = 0;
+    AllocCounter allocs;
+    auto start = Clock::now();
+    for (size_t i = 0; i < n; i++) {
+        int64_t id;
+        Bounds b;
+        if (how == ParamDecoding::Index) {
+            id = params[0].get<int64_t>();
+            b = { params[1][0].get<long>(), params[1][1].get<long>(),
+                  params[1][2].get<long>(), params[1][3].get<long>() };
+        } else if (how == ParamDecoding::Vector) {
+            id = params[0].get<int64_t>();
+            auto v = params[1].get<std::vector<long>>();
+            b = { v[0], v[1], v[2], v[3] };
+        } else {
+            auto [tid, v] = jsonrpc::details::decode_params<int64_t, std::array<long, 4>>(params);
+            id = tid;
+            b = { v[0], v[1], v[2], v[3] };
+        }
+        sum += id + b.left + b.top + b.right + b.bottom;
+    }
+    double seconds = since(start);
+    if (sum != (int64_t)n * (42 + 1280 + 720)) std::abort();
+    const char* name = how == ParamDecoding::Index ? "params_by_index"
+                     : how == ParamDecoding::Vector ? "params_by_vector" : "params_typed";
+    json extra = allocs.per_message(n);
+    extra["ns_per_msg"] = n ? seconds * 1e9 / n : 0.0;
+    report(name, 0, n, params.dump().size() * n, seconds, extra);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (std::string_view(argv[i]) == "--quick") g_quick = true;
+    }
+    bench_frame_parse();
+    bench_decode(false);
+    bench_decode(true);
+    bench_encoding(jsonrpc::Encoding::Json);
+    bench_encoding(jsonrpc::Encoding::Cbor);
+    bench_encoding(jsonrpc::Encoding::MsgPack);
+    bench_arena_retention(false);
+    bench_arena_retention(true);
+    bench_pipe_frames(true);
+    bench_pipe_frames(false);
+    bench_spsc();
+    bench_dispatch(false);
+    bench_dispatch(true);
+    bench_notify();
+    bench_encode(false);
+    bench_encode(true);
+    bench_round_trip();
+    bench_blob(false);
+    bench_blob(true);
+    bench_coroutine(false);
+    bench_coroutine(true);
+    bench_params(ParamDecoding::Index);
+    bench_params(ParamDecoding::Vector);
+    bench_params(ParamDecoding::Typed);
+    return 0;
+}
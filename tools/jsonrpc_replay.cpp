@@ -0,0 +1,214 @@
+// Replays a traffic log written by Conn::start_recording() (wv2.exe
+// --record <file>) into a Conn backed by stub handlers, so a recorded
+// Emacs session runs anywhere as a regression benchmark:
+//
+//     g++ -std=c++20 -O2 -I.. jsonrpc_replay.cpp -pthread -o jsonrpc_replay
+//     ./jsonrpc_replay session.log [--speed recorded|max]
+//
+// Only the incoming frames are replayed; the recorded replies are ignored.
+// "max" (the default) feeds frames as fast as the connection takes them,
+// "recorded" keeps the original gaps between them. The result is one JSON
+// object on stdout, in the format of jsonrpc_bench, with the latency from
+// feeding each request to reading its reply.
+
+#include "jsonrpc.hpp"
+#include "harness.hpp"
+
+#include <cstdio>
+#include <unordered_map>
+
+using jsonrpc::json;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Frame {
+    std::string bytes;      // Header and body, as Emacs would send it.
+    int64_t ts = 0;         // Recorded time, microseconds.
+    std::optional<int> id;  // Request id, if the frame is a single request.
+};
+
+// Options of the methods registered by webview_init(), so merging, lanes
+// and worker dispatch behave as in the manager.
+jsonrpc::MethodOptions options_of(const std::string& method) {
+    jsonrpc::MethodOptions options;
+    if (method == "env/create" || method == "wv/create" || method == "wv/get-html") {
+        options.lane = jsonrpc::Lane::Bulk;
+    } else if (method == "add" || method == "echo") {
+        options.affinity = jsonrpc::Affinity::AnyThread;
+    } else if (method == "wv/resize" || method == "wv/set-visible" || method == "wv/reparent") {
+        options.merge.key = [](const json& p) -> std::optional<int64_t> {
+            if (p.is_array() && !p.empty() && p[0].is_number_integer()) return p[0].get<int64_t>();
+            return std::nullopt;
+        };
+    } else if (method == "wv/sync-ui-batch") {
+        // Dropping older batches is close enough for a stub.
+        options.merge.key = [](const json&) -> std::optional<int64_t> { return 0; };
+    }
+    return options;
+}
+
+// Stub backend: every method seen in the log answers at once. Creation
+// methods return fresh ids, so later requests look plausible.
+void register_stubs(jsonrpc::Conn& conn, const std::vector<std::string>& methods) {
+    auto next_id = std::make_shared<int64_t>(1);
+    for (const auto& m : methods) {
+        if (m.starts_with("$/")) continue; // Built into Conn.
+        bool creates = m == "env/create" || m == "wv/create";
+        conn.register_async_method(m, [creates, next_id](jsonrpc::Context ctx, const json& params) {
+            if (ctx.is_notification()) return;
+            if (creates) {
+                ctx.reply((*next_id)++);
+            } else {
+                ctx.reply(params.is_array() && params.size() == 1 ? params[0] : json(nullptr));
+            }
+        }, options_of(m));
+    }
+}
+
+// Load the incoming frames of a log. Fills `methods` with every method
+// name requested or notified.
+bool load(const std::string& path, std::vector<Frame>& frames, std::vector<std::string>& methods) {
+    jsonrpc::record::LogReader log;
+    if (!log.open(path)) return false;
+    jsonrpc::record::Record r;
+    jsonrpc::MessageDecoder decoder;
+    jsonrpc::DecodedFrame decoded;
+    while (log.next(r)) {
+        if (r.kind != jsonrpc::record::Kind::In) continue;
+        auto enc = (jsonrpc::Encoding)r.encoding;
+        Frame f;
+        f.ts = r.ts;
+        f.bytes = "Content-Length: " + std::to_string(r.data.size()) + "\r\n";
+        if (enc != jsonrpc::Encoding::Json) {
+            f.bytes += "Content-Type: " + std::string(jsonrpc::content_type(enc)) + "\r\n";
+        }
+        f.bytes += "\r\n";
+        f.bytes += r.data;
+        if (decoder.decode(r.data, decoded, enc).ok()) {
+            for (const auto& msg : decoded.messages) {
+                if (auto req = std::get_if<jsonrpc::Request>(&msg)) {
+                    if (std::find(methods.begin(), methods.end(), req->method) == methods.end()) {
+                        methods.push_back(req->method);
+                    }
+                    if (!decoded.batch) f.id = req->id;
+                }
+            }
+        }
+        frames.push_back(std::move(f));
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string path;
+    bool recorded_speed = false;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--speed" && i + 1 < argc) {
+            recorded_speed = std::string_view(argv[++i]) == "recorded";
+        } else {
+            path = arg;
+        }
+    }
+    if (path.empty()) {
+        std::fprintf(stderr, "usage: %s <log> [--speed recorded|max]\n", argv[0]);
+        return 2;
+    }
+    std::vector<Frame> frames;
+    std::vector<std::string> methods;
+    if (!load(path, frames, methods)) {
+        std::fprintf(stderr, "%s: not a traffic log\n", path.c_str());
+        return 1;
+    }
+    size_t requests = 0, bytes = 0;
+    for (const auto& f : frames) {
+        requests += f.id.has_value();
+        bytes += f.bytes.size();
+    }
+
+    Pipe to_conn, from_conn;
+    std::istream conn_in(&to_conn), out_in(&from_conn);
+    std::ostream feed(&to_conn), conn_out(&from_conn);
+    std::ostringstream err;
+    EventLoop loop;
+    jsonrpc::Conn conn(loop.waker(), conn_in, conn_out, err, SIZE_MAX);
+    register_stubs(conn, methods);
+
+    std::mutex sent_mutex;
+    std::unordered_map<int, Clock::time_point> sent;
+    jsonrpc::LatencyHistogram latency;
+    std::atomic<size_t> replies{ 0 };
+
+    // Read the replies and match them to the requests.
+    std::thread reader([&] {
+        jsonrpc::FrameReader frames_out(jsonrpc::istream_source(out_in), SIZE_MAX);
+        jsonrpc::MessageDecoder decoder;
+        jsonrpc::DecodedFrame decoded;
+        std::string_view body;
+        while (frames_out.next(body) == jsonrpc::FrameReader::Status::Ok) {
+            auto now = Clock::now();
+            if (!decoder.decode(body, decoded, frames_out.encoding()).ok()) continue;
+            for (const auto& msg : decoded.messages) {
+                auto resp = std::get_if<jsonrpc::Response>(&msg);
+                if (!resp) continue;
+                std::lock_guard<std::mutex> lock(sent_mutex);
+                auto it = sent.find(resp->id);
+                if (it == sent.end()) continue;
+                latency.record(now - it->second);
+                sent.erase(it);
+                replies++;
+            }
+        }
+    });
+
+    conn.start();
+    auto start = Clock::now();
+    std::atomic<bool> fed{ false };
+    std::thread feeder([&] {
+        for (const auto& f : frames) {
+            if (recorded_speed) {
+                std::this_thread::sleep_until(start + std::chrono::microseconds(f.ts - frames.front().ts));
+            }
+            if (f.id) {
+                std::lock_guard<std::mutex> lock(sent_mutex);
+                sent[*f.id] = Clock::now();
+            }
+            feed.write(f.bytes.data(), (std::streamsize)f.bytes.size());
+        }
+        fed = true;
+        loop.waker()();
+    });
+
+    // Requests the stubs leave unanswered (none, normally) end the run
+    // after a second of silence.
+    auto last_progress = Clock::now();
+    size_t last_replies = 0;
+    loop.run(conn, [&] {
+        if (replies != last_replies) {
+            last_replies = replies;
+            last_progress = Clock::now();
+        }
+        return fed && (replies == requests || Clock::now() - last_progress > std::chrono::seconds(1));
+    });
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    feeder.join();
+    to_conn.close();
+    conn.stop();
+    from_conn.close();
+    reader.join();
+
+    json result = {
+        {"bench", "replay"}, {"log", path}, {"speed", recorded_speed ? "recorded" : "max"},
+        {"messages", frames.size()}, {"requests", requests}, {"replies", replies.load()},
+        {"bytes", bytes}, {"seconds", seconds},
+        {"msgs_per_sec", seconds > 0 ? frames.size() / seconds : 0.0},
+        {"mb_per_sec", seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0.0},
+        {"latency_us", latency.summary()},
+        {"stats", conn.stats_json()},
+    };
+    std::printf("%s\n", result.dump().c_str());
+    return replies == requests ? 0 : 1;
+}
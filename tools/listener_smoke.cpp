@@ -0,0 +1,112 @@
+// Smoke test of the Listener transport (listener.hpp): a client Conn
+// connects to a local endpoint and sends requests that must all be
+// answered, which takes reads and writes on each end of the session at
+// the same time.
+//
+//     g++ -std=c++20 -O2 -I.. listener_smoke.cpp -pthread -o listener_smoke
+//     cl /std:c++20 /EHsc /I.. listener_smoke.cpp
+//     ./listener_smoke [endpoint]
+//
+// The endpoint defaults to \\.\pipe\wv2-smoke-<pid> on Windows and to a
+// socket in /tmp elsewhere. Prints "ok" and exits 0, or says what failed
+// and exits 1.
+
+#include "jsonrpc.hpp"
+#include "listener.hpp"
+#include "harness.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using jsonrpc::json;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr int kRequests = 100;
+
+[[noreturn]] void fail(const std::string& what) {
+    std::fprintf(stderr, "listener_smoke: %s\n", what.c_str());
+    std::fflush(stderr);
+    // A stuck session leaves threads blocked in I/O; don't wait for them.
+    std::_Exit(1);
+}
+
+std::string default_endpoint() {
+#ifdef _WIN32
+    return "\\\\.\\pipe\\wv2-smoke-" + std::to_string(GetCurrentProcessId());
+#else
+    return "/tmp/wv2-smoke-" + std::to_string(getpid()) + ".sock";
+#endif
+}
+
+jsonrpc::details::NativeHandle connect_to(const std::string& endpoint) {
+#ifdef _WIN32
+    // Overlapped like the server end, so the client's reader and writer
+    // threads don't serialize either.
+    return CreateFileW(jsonrpc::details::pipe_name(endpoint).c_str(), GENERIC_READ | GENERIC_WRITE,
+        0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+#else
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, endpoint.c_str(), endpoint.size() + 1);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && ::connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    return fd;
+#endif
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string endpoint = argc > 1 ? argv[1] : default_endpoint();
+    EventLoop loop;
+    jsonrpc::Listener listener(loop.waker(), [](jsonrpc::Conn& conn, jsonrpc::Listener::SessionId) {
+        conn.register_method("echo", [](const json& params) -> json { return params; });
+    });
+    if (!listener.listen(endpoint)) fail("cannot listen on " + endpoint);
+
+    auto h = connect_to(endpoint);
+    if (h == jsonrpc::details::kInvalidHandle) fail("cannot connect to " + endpoint);
+    jsonrpc::Conn client(loop.waker(), jsonrpc::details::handle_source(h), jsonrpc::details::handle_sink(h));
+    client.start();
+
+    // All sent at once, so the manager reads the next ones while it writes
+    // the first replies.
+    int answered = 0;
+    for (int i = 0; i < kRequests; i++) {
+        client.send_request("echo", json::array({ i }), [&answered, i](const jsonrpc::Response& r) {
+            if (r.is_error()) fail("request " + std::to_string(i) + " failed: " + std::get<jsonrpc::Error>(r.content).message);
+            if (std::get<json>(r.content) != json::array({ i })) fail("wrong reply to request " + std::to_string(i));
+            answered++;
+            }, std::chrono::seconds(5));
+    }
+    auto deadline = Clock::now() + std::chrono::seconds(10);
+    while (answered < kRequests) {
+        if (Clock::now() > deadline) fail("no replies, the session is stuck");
+        {
+            std::unique_lock<std::mutex> lock(loop.mutex);
+            loop.cv.wait_for(lock, std::chrono::milliseconds(10), [&loop] { return loop.pending; });
+            loop.pending = false;
+        }
+        listener.process_queue();
+        client.process_queue();
+    }
+    if (listener.session_count() != 1) fail("expected one session");
+
+    jsonrpc::details::shutdown_handle(h);
+    client.stop();
+    jsonrpc::details::close_handle(h);
+    listener.stop();
+    std::printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,261 @@
+// Chrome trace-event recorder for the manager, see
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+// The written file opens in Perfetto (ui.perfetto.dev) or about:tracing.
+//
+// Each thread records into its own fixed-size ring, written only by that
+// thread and published with a release store, so recording takes no lock.
+// When tracing is off a span costs one relaxed atomic load.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "json.hpp"
+
+namespace jsonrpc {
+namespace trace {
+
+using Clock = std::chrono::steady_clock;
+
+// One trace event. Names must be string literals or otherwise outlive
+// the trace, e.g. from intern(); they are stored as pointers.
+struct Event {
+    const char* name = nullptr;
+    const char* cat = nullptr;
+    const char* detail = nullptr; // Optional, e.g. the method name.
+    char phase = 'X';             // 'X' complete, 'i' instant, 'b'/'e' async.
+    int64_t ts = 0;               // Microseconds.
+    int64_t dur = 0;
+    int64_t request = -1;         // JSON-RPC id, -1 if none.
+    int64_t webview = -1;         // Webview id, -1 if none.
+    uint64_t async_id = 0;
+};
+
+namespace details {
+
+constexpr size_t kRingSize = 1 << 14; // Events per thread, oldest overwritten.
+
+struct Ring {
+    std::unique_ptr<Event[]> events; // Allocated on the first event.
+    std::atomic<uint64_t> head{ 0 };
+    uint32_t tid = 0;
+    std::string thread_name;
+};
+
+inline std::atomic<bool> g_enabled{ false };
+inline std::atomic<int64_t> g_start_ts{ 0 };
+inline std::atomic<uint64_t> g_next_async_id{ 1 };
+
+inline std::mutex& registry_mutex() {
+    static std::mutex m;
+    return m;
+}
+
+// Rings outlive their threads, so a trace still shows exited threads.
+inline std::vector<std::shared_ptr<Ring>>& registry() {
+    static std::vector<std::shared_ptr<Ring>> rings;
+    return rings;
+}
+
+inline Ring& local_ring() {
+    thread_local std::shared_ptr<Ring> ring = [] {
+        auto r = std::make_shared<Ring>();
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        r->tid = (uint32_t)registry().size() + 1;
+        registry().push_back(r);
+        return r;
+    }();
+    return *ring;
+}
+
+inline void push(const Event& e) {
+    Ring& r = local_ring();
+    if (!r.events) {
+        r.events = std::make_unique<Event[]>(kRingSize);
+    }
+    uint64_t h = r.head.load(std::memory_order_relaxed);
+    r.events[h % kRingSize] = e;
+    r.head.store(h + 1, std::memory_order_release);
+}
+
+} // namespace details
+
+// A copy of name that lives as long as the process, for names and details
+// owned by something the trace may outlive, such as a session's Conn.
+inline const char* intern(std::string_view name) {
+    static auto* m = new std::mutex;
+    static auto* names = new std::set<std::string, std::less<>>;
+    std::lock_guard<std::mutex> lock(*m);
+    auto it = names->find(name);
+    if (it == names->end()) it = names->emplace(name).first;
+    return it->c_str();
+}
+
+inline int64_t to_us(Clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+}
+
+inline bool enabled() {
+    return details::g_enabled.load(std::memory_order_relaxed);
+}
+
+// Start recording. Events from an earlier session are left out of the export.
+inline void start() {
+    details::g_start_ts.store(to_us(Clock::now()), std::memory_order_relaxed);
+    details::g_enabled.store(true, std::memory_order_relaxed);
+}
+
+inline void stop() {
+    details::g_enabled.store(false, std::memory_order_relaxed);
+}
+
+// Name the calling thread in the trace.
+inline void set_thread_name(const char* name) {
+    auto& r = details::local_ring();
+    std::lock_guard<std::mutex> lock(details::registry_mutex());
+    r.thread_name = name;
+}
+
+inline void complete(const char* cat, const char* name, Clock::time_point begin, Clock::time_point end,
+                     int64_t request = -1, int64_t webview = -1, const char* detail = nullptr) {
+    if (!enabled()) return;
+    Event e;
+    e.name = name;
+    e.cat = cat;
+    e.detail = detail;
+    e.ts = to_us(begin);
+    e.dur = to_us(end) - e.ts;
+    e.request = request;
+    e.webview = webview;
+    details::push(e);
+}
+
+inline void instant(const char* cat, const char* name, int64_t request = -1, int64_t webview = -1,
+                    const char* detail = nullptr) {
+    if (!enabled()) return;
+    Event e;
+    e.name = name;
+    e.cat = cat;
+    e.detail = detail;
+    e.phase = 'i';
+    e.ts = to_us(Clock::now());
+    e.request = request;
+    e.webview = webview;
+    details::push(e);
+}
+
+// A span that started on another thread or overlaps other work, e.g. the
+// time a message waits in the inbox. Drawn on its own async track.
+inline void async_span(const char* cat, const char* name, Clock::time_point begin, Clock::time_point end,
+                       int64_t request = -1, const char* detail = nullptr) {
+    if (!enabled()) return;
+    Event e;
+    e.name = name;
+    e.cat = cat;
+    e.detail = detail;
+    e.phase = 'b';
+    e.ts = to_us(begin);
+    e.request = request;
+    e.async_id = details::g_next_async_id.fetch_add(1, std::memory_order_relaxed);
+    details::push(e);
+    e.phase = 'e';
+    e.ts = to_us(end);
+    details::push(e);
+}
+
+// Records a complete event for its scope, if tracing was on when it began.
+class Span {
+public:
+    Span(const char* cat, const char* name, int64_t request = -1, int64_t webview = -1,
+         const char* detail = nullptr)
+        : cat_(cat), name_(name), detail_(detail), request_(request), webview_(webview) {
+        if (enabled()) begin_ = Clock::now();
+    }
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+    ~Span() {
+        if (begin_ != Clock::time_point{}) {
+            complete(cat_, name_, begin_, Clock::now(), request_, webview_, detail_);
+        }
+    }
+
+    void set_request(int64_t id) { request_ = id; }
+    void set_webview(int64_t id) { webview_ = id; }
+    void set_detail(const char* detail) { detail_ = detail; }
+
+private:
+    const char* cat_;
+    const char* name_;
+    const char* detail_;
+    int64_t request_;
+    int64_t webview_;
+    Clock::time_point begin_{};
+};
+
+// The recorded events as a Chrome trace-event document.
+// Safe to call while other threads keep recording: events overwritten
+// during the copy are skipped.
+inline nlohmann::json to_json() {
+    using nlohmann::json;
+    json events = json::array();
+    int64_t start_ts = details::g_start_ts.load(std::memory_order_relaxed);
+    std::vector<std::shared_ptr<details::Ring>> rings;
+    {
+        std::lock_guard<std::mutex> lock(details::registry_mutex());
+        rings = details::registry();
+        for (const auto& r : rings) {
+            if (r->thread_name.empty()) continue;
+            events.push_back({ {"ph", "M"}, {"name", "thread_name"}, {"pid", 1}, {"tid", r->tid},
+                               {"args", {{"name", r->thread_name}}} });
+        }
+    }
+    std::vector<Event> copy;
+    for (const auto& r : rings) {
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        if (head == 0) continue;
+        uint64_t first = head > details::kRingSize ? head - details::kRingSize : 0;
+        copy.assign(r->events.get(), r->events.get() + details::kRingSize);
+        // Slots the writer reused meanwhile may be torn.
+        uint64_t now = r->head.load(std::memory_order_acquire);
+        if (now >= details::kRingSize && now - details::kRingSize + 1 > first) {
+            first = now - details::kRingSize + 1;
+        }
+        for (uint64_t i = first; i < head; i++) {
+            const Event& e = copy[i % details::kRingSize];
+            if (e.ts < start_ts) continue;
+            json ev = { {"name", e.name}, {"cat", e.cat}, {"ph", std::string(1, e.phase)},
+                        {"ts", e.ts}, {"pid", 1}, {"tid", r->tid} };
+            if (e.phase == 'X') ev["dur"] = e.dur;
+            if (e.phase == 'i') ev["s"] = "t";
+            if (e.phase == 'b' || e.phase == 'e') ev["id"] = e.async_id;
+            json args = json::object();
+            if (e.request >= 0) args["request"] = e.request;
+            if (e.webview >= 0) args["webview"] = e.webview;
+            if (e.detail) args["detail"] = e.detail;
+            if (!args.empty()) ev["args"] = std::move(args);
+            events.push_back(std::move(ev));
+        }
+    }
+    return json{ {"traceEvents", std::move(events)}, {"displayTimeUnit", "ms"} };
+}
+
+// Write the trace to path. Returns the number of events, or -1 on failure.
+inline int64_t write(const std::string& path) {
+    auto doc = to_json();
+    std::ofstream out(path, std::ios::binary);
+    if (!out) return -1;
+    out << doc.dump();
+    return out ? (int64_t)doc["traceEvents"].size() : -1;
+}
+
+} // namespace trace
+} // namespace jsonrpc
@@ -1,5 +1,6 @@
 #include "pch.h"
 #include "wv2_mgmt.h"
+#include "wv2_async.h"
 #include <WebView2EnvironmentOptions.h>
 #include <format>
 
@@ -7,17 +8,7 @@ using Microsoft::WRL::Callback;
 using Microsoft::WRL::ComPtr;
 
 namespace utils {
-static auto add(const jsonrpc::json& params) -> jsonrpc::json {
-    if (!params.is_array() || params.size() != 2) {
-        throw jsonrpc::JsonRpcException(jsonrpc::spec::kInvalidParams, "Argument must be array of length 2");
-    }
-    if (!params[0].is_number() || !params[1].is_number()) {
-        throw jsonrpc::JsonRpcException(jsonrpc::spec::kInvalidParams, "Argument is not number");
-    }
-    return params[0].get<double>() + params[1].get<double>();
-}
-
-static std::wstring utf8_to_wstring(const std::string& utf8_str) {
+static std::wstring utf8_to_wstring(std::string_view utf8_str) {
     if (utf8_str.empty()) {
         return std::wstring();
     }
@@ -78,6 +69,35 @@ static uint32_t pack_emacs_key(UINT vkey, bool c, bool m, bool s, bool w) {
 
 namespace u = utils;
 
+// Win32 types in typed params, see jsonrpc::ParamTraits.
+namespace jsonrpc {
+
+// [left, top, right, bottom]
+template <>
+struct ParamTraits<RECT> {
+    static bool decode(const json& j, RECT& out) {
+        std::array<LONG, 4> v;
+        if (!ParamTraits<std::array<LONG, 4>>::decode(j, v)) return false;
+        out = { v[0], v[1], v[2], v[3] };
+        return true;
+    }
+    static std::string describe() { return "[left, top, right, bottom]"; }
+};
+
+// A window handle, as the integer Emacs gets from (frame-parameter nil 'window-id).
+template <>
+struct ParamTraits<HWND> {
+    static bool decode(const json& j, HWND& out) {
+        int64_t v = 0;
+        if (!ParamTraits<int64_t>::decode(j, v)) return false;
+        out = (HWND)(intptr_t)v;
+        return true;
+    }
+    static std::string describe() { return "window handle"; }
+};
+
+} // namespace jsonrpc
+
 void WebViewInstance::setup_all_events() {
     bind_event<ICoreWebView2DocumentTitleChangedEventHandler>(
         webview,
@@ -100,18 +120,20 @@ void WebViewInstance::setup_all_events() {
 }
 
 HRESULT WebViewInstance::on_title_changed(ICoreWebView2* sender, IUnknown* args) {
+    jsonrpc::trace::Span span("webview", "on_title_changed", -1, this->id);
     wil::unique_cotaskmem_string title;
     sender->get_DocumentTitle(&title);
 
     jsonrpc::json params;
     params["id"] = this->id;
     params["title"] = u::wstring_to_utf8(title.get());
-    g_app->server.send_notification("wv/title-changed", params);
+    notify("wv/title-changed", params);
 
     return S_OK;
 }
 
 HRESULT WebViewInstance::on_key_pressed(ICoreWebView2Controller* sender, ICoreWebView2AcceleratorKeyPressedEventArgs* args) {
+    jsonrpc::trace::Span span("webview", "on_key_pressed", -1, this->id);
     COREWEBVIEW2_KEY_EVENT_KIND kind;
     args->get_KeyEventKind(&kind);
     if (kind != COREWEBVIEW2_KEY_EVENT_KIND_KEY_DOWN &&
@@ -133,7 +155,7 @@ HRESULT WebViewInstance::on_key_pressed(ICoreWebView2Controller* sender, ICoreWe
         jsonrpc::json params;
         params["id"] = this->id;
         params["key"] = current_packed;
-        g_app->server.send_notification("input/event", params);
+        notify("input/event", params);
     }
     return S_OK;
 }
@@ -145,38 +167,37 @@ HRESULT WebViewInstance::on_new_window(ICoreWebView2* sender, ICoreWebView2NewWi
 
     jsonrpc::json params;
     params["url"] = u::wstring_to_utf8(uri.get());
-    g_app->server.send_notification("wv/new-window-requested", params);
+    notify("wv/new-window-requested", params);
 
     return S_OK;
 }
 
-void WebViewInstance::Create(WebViewInitParams params) {
-    auto env = params.env;
-    HWND hwnd = params.hwnd;
-    env->CreateCoreWebView2Controller(hwnd, Callback<ICoreWebView2CreateCoreWebView2ControllerCompletedHandler>(
-        [p = std::move(params)](HRESULT result, ICoreWebView2Controller* controller) mutable -> HRESULT {
-            if (FAILED(result)) {
-                p.on_error(result);
-                return result;
-            }
-            auto instance = std::make_shared<WebViewInstance>();
-            instance->id = p.id;
-            instance->controller = controller;
-            instance->controller->get_CoreWebView2(&instance->webview);
-            instance->controller->put_Bounds(p.bounds);
-            instance->controller->put_IsVisible(p.visible);
-            instance->setup_all_events();
-
-            g_app->webviews[p.id] = instance;
-            if (!p.url.empty()) {
-                instance->webview->Navigate(p.url.c_str());
-            }
-            p.on_created(p.id);
-            return S_OK;
-        }).Get());
+void WebViewInstance::notify(const std::string& method, const jsonrpc::json& params) {
+    if (auto conn = g_app->conn_of(session)) {
+        conn->send_notification(method, params);
+    }
+}
+
+std::shared_ptr<WebViewInstance> WebViewInstance::Create(const WebViewInitParams& p, ComPtr<ICoreWebView2Controller> controller) {
+    auto instance = std::make_shared<WebViewInstance>();
+    instance->id = p.id;
+    instance->session = p.session;
+    instance->controller = std::move(controller);
+    instance->controller->get_CoreWebView2(&instance->webview);
+    instance->controller->put_Bounds(p.bounds);
+    instance->controller->put_IsVisible(p.visible);
+    instance->setup_all_events();
+
+    g_app->webviews[p.id] = instance;
+    if (!p.url.empty()) {
+        instance->webview->Navigate(p.url.c_str());
+    }
+    return instance;
 }
 
 void WebViewInstance::close() {
+    // Once closed, WebView2 may drop their completions.
+    pending.abort();
     for (auto it = cleanup_tasks.rbegin(); it != cleanup_tasks.rend(); it++) {
         (*it)();
     }
@@ -188,15 +209,29 @@ void WebViewInstance::close() {
     webview = nullptr;
 }
 
-static void handle_env_create(jsonrpc::Context ctx, const jsonrpc::json& params) {
+// Webview `id` if `session` owns it, nullptr otherwise.
+static WebViewInstance* find_webview(int64_t session, int64_t id) {
+    if (!g_app) return nullptr;
+    auto it = g_app->webviews.find(id);
+    if (it == g_app->webviews.end() || it->second->session != session) {
+        return nullptr;
+    }
+    return it->second.get();
+}
+
+void webview_release_session(int64_t session) {
+    std::erase_if(g_app->webviews, [session](const auto& pair) { return pair.second->session == session; });
+}
+
+static jsonrpc::Task handle_env_create(jsonrpc::Context ctx, const jsonrpc::json& params) {
     if (!params.is_object() && !params.is_null()) {
         ctx.error(jsonrpc::spec::kInvalidParams, "Invalid params: expect a config object");
-        return;
+        co_return;
     }
     std::string env_name = u::get_opt<std::string>(params, "name", "default");
     if (g_app->envs.find(env_name) != g_app->envs.end()) {
         ctx.reply(true);
-        return;
+        co_return;
     }
     std::wstring user_data_dir = u::utf8_to_wstring(u::get_opt<std::string>(params, "user_data_dir", ""));
     std::wstring lang = u::utf8_to_wstring(u::get_opt<std::string>(params, "language", ""));
@@ -210,30 +245,30 @@ static void handle_env_create(jsonrpc::Context ctx, const jsonrpc::json& params)
         options->put_AdditionalBrowserArguments(args.c_str());
     }
 
-    CreateCoreWebView2EnvironmentWithOptions(nullptr,
-        user_data_dir.empty() ? nullptr : user_data_dir.c_str(),
-        options.Get(),
-        Callback<ICoreWebView2CreateCoreWebView2EnvironmentCompletedHandler>(
-        [ctx, env_name](HRESULT result, ICoreWebView2Environment* env) mutable {
-            if (FAILED(result) || !env) {
-                std::stringstream ss;
-                ss << "Failed to create environment (HRESULT: 0x" << std::hex << result << ")";
-                ctx.error(jsonrpc::spec::kInternalError, ss.str());
-                return result;
-            }
-            if (g_app) {
-                g_app->envs[env_name] = env;
-                ctx.reply(true);
-            }
-            return S_OK;
-        }).Get());
+    auto [result, env] = co_await wv2::create_environment(
+        user_data_dir.empty() ? nullptr : user_data_dir.c_str(), options.Get());
+    jsonrpc::trace::Span span("webview", "environment_created", ctx.id().value_or(-1));
+    if (FAILED(result) || !env) {
+        std::stringstream ss;
+        ss << "Failed to create environment (HRESULT: 0x" << std::hex << result << ")";
+        ctx.error(jsonrpc::spec::kInternalError, ss.str());
+        co_return;
+    }
+    // Emacs gave up on this environment: dropping it lets the
+    // browser process exit.
+    if (ctx.cancelled()) {
+        co_return;
+    }
+    if (g_app) {
+        g_app->envs[env_name] = env;
+        ctx.reply(true);
+    }
 }
 
-static void handle_webview_create(jsonrpc::Context ctx, const jsonrpc::json& params) {
+static jsonrpc::Task handle_webview_create(jsonrpc::Context ctx, const jsonrpc::json& params, int64_t session) {
     const jsonrpc::json& params2 = params.is_null() ? jsonrpc::json::object() : params;
     int64_t hwnd_val = params2.value("hwnd", 0);
     bool visible_val = params2.value("visible", false);
-    auto rect_json = params2.value("bounds", std::vector<long>{0, 0, 0, 0});
     std::string url_value = params2.value("url", "");
     std::string env_name = params2.value("environment", "default");
 
@@ -245,25 +280,95 @@ static void handle_webview_create(jsonrpc::Context ctx, const jsonrpc::json& par
         init_args.visible = TRUE;
     }
     init_args.bounds = { 0, 0, 0, 0 };
-    if (hwnd_val != 0 && visible_val) {
-        auto b = params2["bounds"].get<std::vector<long>>();
-        init_args.bounds = { b[0], b[1], b[2], b[3] };
+    auto bounds = params2.find("bounds");
+    if (hwnd_val != 0 && visible_val && bounds != params2.end() &&
+        !jsonrpc::ParamTraits<RECT>::decode(*bounds, init_args.bounds)) {
+        throw jsonrpc::JsonRpcException(jsonrpc::spec::kInvalidParams, "Invalid params: bounds must be [left, top, right, bottom]");
     }
     init_args.url = url_value.empty() ? L"" : u::utf8_to_wstring(url_value);
+    init_args.session = session;
 
     auto it = g_app->envs.find(env_name);
     if (it == g_app->envs.end()) {
         ctx.error(jsonrpc::spec::kInternalError, std::format("WebView2 Environment not exist: {}", env_name));
-        return;
+        co_return;
+    }
+    // Held by the frame, in case env/create replaces the environment meanwhile.
+    ComPtr<ICoreWebView2Environment> env = it->second;
+
+    auto [result, controller] = co_await wv2::create_controller(env.Get(), init_args.hwnd);
+    jsonrpc::trace::Span span("webview", "controller_created", ctx.id().value_or(-1), init_args.id);
+    if (FAILED(result)) {
+        ctx.error(jsonrpc::spec::kInternalError, "Failed to create controller", std::format("{}", result));
+        co_return;
+    }
+    // Emacs gave up on this webview, don't keep a browser for it.
+    if (ctx.cancelled() || !g_app) {
+        controller->Close();
+        co_return;
     }
-    init_args.env = it->second;
-    init_args.on_created = [ctx](int64_t id) mutable { ctx.reply(id); };
-    init_args.on_error = [ctx](HRESULT result) mutable {ctx.error(jsonrpc::spec::kInternalError, "Failed to create controller", std::format("{}", result)); };
+    WebViewInstance::Create(init_args, std::move(controller));
+    ctx.reply(init_args.id);
+}
 
-    WebViewInstance::Create(std::move(init_args));
+// Page HTML can be megabytes, so it goes back as a stream of chunks
+// ($/streamChunk) instead of one big reply.
+static jsonrpc::Task handle_get_html(jsonrpc::Context ctx, const jsonrpc::json& params, int64_t session) {
+    if (params.empty() || !params[0].is_number_integer()) {
+        throw jsonrpc::JsonRpcException(jsonrpc::spec::kInvalidParams, "Invalid parameters: missing webview ID");
+    }
+    WebViewInstance* inst = find_webview(session, params[0].get<int64_t>());
+    if (!inst) {
+        ctx.reply(false);
+        co_return;
+    }
+    auto [result, result_json] = co_await wv2::execute_script(inst->webview.Get(), L"document.documentElement.outerHTML", &inst->pending);
+    if (FAILED(result)) {
+        ctx.error(jsonrpc::spec::kInternalError, "Failed to execute script", std::format("{}", result));
+        co_return;
+    }
+    // The script result is JSON-encoded, a string here.
+    auto html = jsonrpc::json::parse(u::wstring_to_utf8(result_json), nullptr, false);
+    if (!html.is_string()) {
+        ctx.reply(nullptr);
+        co_return;
+    }
+    ctx.stream_text(html.get_ref<const std::string&>());
+    ctx.end_stream();
+}
+
+// PNG screenshot of the page. Captures run to megabytes, so the reply goes
+// through the blob region when Emacs opened one.
+static jsonrpc::Task handle_capture(jsonrpc::Context ctx, const jsonrpc::json& params, int64_t session) {
+    if (params.empty() || !params[0].is_number_integer()) {
+        throw jsonrpc::JsonRpcException(jsonrpc::spec::kInvalidParams, "Invalid parameters: missing webview ID");
+    }
+    WebViewInstance* inst = find_webview(session, params[0].get<int64_t>());
+    if (!inst) {
+        ctx.reply(false);
+        co_return;
+    }
+    ComPtr<IStream> stream;
+    HRESULT hr = CreateStreamOnHGlobal(nullptr, TRUE, &stream);
+    if (FAILED(hr)) {
+        ctx.error(jsonrpc::spec::kInternalError, "Failed to create stream", std::format("{}", hr));
+        co_return;
+    }
+    HRESULT result = co_await wv2::capture_preview(inst->webview.Get(), COREWEBVIEW2_CAPTURE_PREVIEW_IMAGE_FORMAT_PNG, stream.Get(),
+                                                &inst->pending);
+    HGLOBAL mem = nullptr;
+    STATSTG stat{};
+    if (FAILED(result) || FAILED(GetHGlobalFromStream(stream.Get(), &mem)) ||
+        FAILED(stream->Stat(&stat, STATFLAG_NONAME))) {
+        ctx.error(jsonrpc::spec::kInternalError, "Failed to capture preview", std::format("{}", result));
+        co_return;
+    }
+    auto data = static_cast<const char*>(GlobalLock(mem));
+    ctx.reply_bytes(std::string_view(data, (size_t)stat.cbSize.QuadPart));
+    GlobalUnlock(mem);
 }
 
-static void handle_sync_ui_batch(const jsonrpc::json& params) {
+static void handle_sync_ui_batch(const jsonrpc::json& params, int64_t session) {
     if (!params.is_array()) return;
 
     auto parse_rect = [](const jsonrpc::json& j) -> RECT {
@@ -280,11 +385,10 @@ static void handle_sync_ui_batch(const jsonrpc::json& params) {
     for (const auto& item : params) {
         if (!item.is_array() || item.size() < 4) continue;
 
-        int id = item[0].get<int>();
-        auto it = g_app->webviews.find(id);
-        if (it == g_app->webviews.end()) continue;
+        WebViewInstance* inst = find_webview(session, item[0].get<int64_t>());
+        if (!inst) continue;
 
-        auto& controller = it->second->controller;
+        auto& controller = inst->controller;
         if (!controller) continue;
 
         bool has_vis_change = !item[1].is_null();
@@ -325,62 +429,154 @@ static void handle_sync_ui_batch(const jsonrpc::json& params) {
     }
 }
 
-using WebViewHandler = std::function<jsonrpc::json(WebViewInstance* inst, const jsonrpc::json& params)>;
-
-static inline jsonrpc::Conn::RequestHandler with_webview(WebViewHandler handler) {
-    return [handler](const jsonrpc::json& params) -> jsonrpc::json {
-        if (params.empty() || !params[0].is_number_integer()) {
-            throw std::runtime_error("Invalid parameters: missing webview ID");
+// Adapt handler(inst, args...) to a typed handler taking the webview id
+// first, for register_method<int64_t, Args...>(). A webview the session
+// does not own answers false.
+template <typename F>
+static auto with_webview(int64_t session, F handler) {
+    return [session, handler = std::move(handler)](int64_t id, auto... args) -> jsonrpc::json {
+        if (WebViewInstance* inst = find_webview(session, id)) {
+            return handler(inst, std::move(args)...);
         }
+        return false;
+        };
+}
 
-        int64_t id = params[0].get<int64_t>();
-
-        if (g_app) {
-            auto it = g_app->webviews.find(id);
-            if (it != g_app->webviews.end()) {
-                return handler(it->second.get(), params);
-            }
+// Same for register_notification<int64_t, Args...>().
+template <typename F>
+static auto with_webview_n(int64_t session, F handler) {
+    return [session, handler = std::move(handler)](int64_t id, auto... args) {
+        if (WebViewInstance* inst = find_webview(session, id)) {
+            handler(inst, std::move(args)...);
         }
-        return false;
         };
 }
 
-using WebViewNotificationHandler = std::function<void(WebViewInstance* inst, const jsonrpc::json& params)>;
+// Merge policy: of the queued notifications for one webview (params[0]),
+// only the latest is applied.
+static jsonrpc::MergePolicy latest_per_webview() {
+    return { [](const jsonrpc::json& params) -> std::optional<int64_t> {
+        if (params.is_array() && !params.empty() && params[0].is_number_integer()) {
+            return params[0].get<int64_t>();
+        }
+        return std::nullopt;
+        } };
+}
 
-static inline jsonrpc::Conn::NotificationHandler with_webview_n(WebViewNotificationHandler handler) {
-    return [handler](const jsonrpc::json& params) {
-        if (params.empty() || !params[0].is_number_integer()) {
-            throw std::runtime_error("Invalid parameters: missing webview ID");
+// Fold an older wv/sync-ui-batch into a newer one. Per webview, fields the
+// newer batch leaves null take the older value; webviews only the older
+// batch mentions are appended.
+static void fold_sync_ui_batch(jsonrpc::json& newer, const jsonrpc::json& older) {
+    if (!newer.is_array() || !older.is_array()) return;
+    auto valid = [](const jsonrpc::json& item) {
+        return item.is_array() && item.size() >= 4 && item[0].is_number_integer();
+        };
+    for (const auto& o : older) {
+        if (!valid(o)) continue;
+        auto n = std::find_if(newer.begin(), newer.end(), [&](const jsonrpc::json& item) {
+            return valid(item) && item[0] == o[0];
+            });
+        if (n == newer.end()) {
+            newer.push_back(o);
+            continue;
+        }
+        for (size_t i = 1; i < 4; i++) {
+            if ((*n)[i].is_null()) (*n)[i] = o[i];
         }
+    }
+}
 
-        int64_t id = params[0].get<int64_t>();
+// Replace each {"$ref": i} in params by the result of call i, or with
+// "pointer" (a JSON Pointer) by a part of it.
+static void resolve_refs(jsonrpc::json& params, const std::vector<jsonrpc::json>& results) {
+    if (params.is_array()) {
+        for (auto& p : params) {
+            resolve_refs(p, results);
+        }
+        return;
+    }
+    if (!params.is_object()) return;
+    auto ref = params.find("$ref");
+    if (ref == params.end()) {
+        for (auto& [key, p] : params.items()) {
+            resolve_refs(p, results);
+        }
+        return;
+    }
+    if (!ref->is_number_unsigned() || ref->get<size_t>() >= results.size()) {
+        throw jsonrpc::JsonRpcException(jsonrpc::spec::kInvalidParams, "$ref must name an earlier call");
+    }
+    const jsonrpc::json& result = results[ref->get<size_t>()];
+    std::string pointer = u::get_opt<std::string>(params, "pointer", "");
+    try {
+        jsonrpc::json value = result.at(jsonrpc::json::json_pointer(pointer));
+        params = std::move(value);
+    } catch (const jsonrpc::json::exception&) {
+        throw jsonrpc::JsonRpcException(jsonrpc::spec::kInvalidParams, std::format("$ref pointer not found: {}", pointer));
+    }
+}
 
-        if (g_app) {
-            auto it = g_app->webviews.find(id);
-            if (it != g_app->webviews.end()) {
-                handler(it->second.get(), params);
-            }
+// app/multi [{"method": m, "params": p}, ...]: run the calls in order, each
+// after the previous one answered, and reply with their outcomes,
+// [{"result": r} | {"error": e}, ...], up to the first error. Params may
+// use the results of earlier calls, see resolve_refs(), so a webview can
+// be created and set up in a single round trip.
+static jsonrpc::Task handle_multi(jsonrpc::Context ctx, const jsonrpc::json& params, jsonrpc::Conn& server) {
+    if (!params.is_array()) {
+        throw jsonrpc::JsonRpcException(jsonrpc::spec::kInvalidParams, "Invalid params: expect an array of calls");
+    }
+    // Copied, params is only valid until the first co_await. The copy is
+    // made outside the frame's arena, so it doesn't hold the arena either.
+    jsonrpc::json calls = params;
+    std::vector<jsonrpc::json> results;
+    jsonrpc::json outcomes = jsonrpc::json::array();
+    for (auto& call : calls) {
+        if (!call.is_object() || !call.contains("method") || !call["method"].is_string()) {
+            throw jsonrpc::JsonRpcException(jsonrpc::spec::kInvalidParams, "Invalid params: a call needs a method");
         }
-        };
+        std::string method = call["method"].get<std::string>();
+        if (method == "app/multi") {
+            throw jsonrpc::JsonRpcException(jsonrpc::spec::kInvalidParams, "app/multi does not nest");
+        }
+        jsonrpc::json call_params = call.contains("params") ? std::move(call["params"]) : jsonrpc::json(nullptr);
+        resolve_refs(call_params, results);
+        jsonrpc::Response resp = co_await server.invoke(ctx, std::move(method), std::move(call_params));
+        if (resp.is_error()) {
+            outcomes.push_back({ {"error", std::get<jsonrpc::Error>(resp.content)} });
+            break;
+        }
+        results.push_back(std::get<jsonrpc::json>(std::move(resp.content)));
+        outcomes.push_back({ {"result", results.back()} });
+    }
+    ctx.reply(std::move(outcomes));
 }
 
-auto webview_init() -> void {
+auto webview_init(jsonrpc::Conn& server, int64_t session) -> void {
     using WI = WebViewInstance*;
     using PA = const jsonrpc::json&;
     using RT = jsonrpc::json;
     using CTX = jsonrpc::Context;
-    auto& server = g_app->server;
+    // Pages animating document.title would otherwise send dozens of these
+    // per second, each renaming a buffer in Emacs.
+    server.coalesce_notifications("wv/title-changed", std::chrono::milliseconds(100));
     // Example method to add two numbers
-    server.register_method("add", u::add);
+    // Neither touches COM or g_app, so they run on the worker pool.
+    server.register_method<double, double>("add", [](double a, double b) -> RT {
+        return a + b;
+        }, { .affinity = jsonrpc::Affinity::AnyThread });
     server.register_method("echo", [](PA params) -> RT {
         return params;
-        });
-    // Exit method to stop the server and exit the message loop
-    server.register_notification("app/exit", [](PA) {
+        }, { .affinity = jsonrpc::Affinity::AnyThread });
+    // Exit method to stop the server and exit the message loop. A --listen
+    // client only disconnects, the manager serves the others.
+    server.register_notification("app/exit", [session](PA) {
+        if (session != kStdioSession) {
+            g_app->listener.close_session(session);
+            return;
+        }
         PostThreadMessage(GetCurrentThreadId(), WM_QUIT, 0, 0);
         });
-    server.register_notification("app/set-focus", [](PA params) {
-        HWND hwnd = (HWND)params[0].get<int64_t>();
+    server.register_notification<HWND>("app/set-focus", [](HWND hwnd) {
         // Darkart, use MENU key to work around the SetForegroundWindow restriction
         // in Windows, which requires the caller to be the foreground process or to
         // have received the last input event. By simulating a key press, we can
@@ -397,10 +593,49 @@ auto webview_init() -> void {
         // select-frame-set-input-focus can grab the focus, we don't need this method.
         // SetFocus(hwnd);
         });
+    // Chrome trace-event recording: {"enable": true} starts it,
+    // {"enable": false, "path": file} stops it and writes the trace to file.
+    server.register_method("app/trace", [](PA params) -> RT {
+        if (u::get_opt<bool>(params, "enable", false)) {
+            jsonrpc::trace::start();
+            return true;
+        }
+        jsonrpc::trace::stop();
+        std::string path = u::get_opt<std::string>(params, "path", "");
+        if (path.empty()) {
+            return true;
+        }
+        int64_t events = jsonrpc::trace::write(path);
+        if (events < 0) {
+            throw jsonrpc::JsonRpcException(jsonrpc::spec::kInternalError, "Failed to write trace file");
+        }
+        return events;
+        });
+    // Traffic log for tools/jsonrpc_replay, {"path": file} starts one and
+    // {} stops it.
+    server.register_method("app/record", [&server](PA params) -> RT {
+        std::string path = u::get_opt<std::string>(params, "path", "");
+        bool ok = path.empty() ? server.stop_recording() : server.start_recording(path);
+        if (!ok) {
+            throw jsonrpc::JsonRpcException(jsonrpc::spec::kInternalError, "Failed to write traffic log");
+        }
+        return true;
+        });
+    // Latency histograms per method, {"reset": true} clears them after reading.
+    server.register_method("app/stats", [&server](PA params) -> RT {
+        auto stats = server.stats_json();
+        if (u::get_opt<bool>(params, "reset", false)) {
+            server.reset_stats();
+        }
+        return stats;
+        });
+    server.register_async_method("app/multi", [&server](CTX ctx, PA params) {
+        return handle_multi(ctx, params, server);
+        }, { .lane = jsonrpc::Lane::Bulk });
     // Create WebView2 Environment
     server.register_async_method("env/create", [](CTX ctx, PA params) {
-        handle_env_create(ctx, params);
-        });
+        return handle_env_create(ctx, params);
+        }, { .lane = jsonrpc::Lane::Bulk });
     server.register_method("env/list-names", [](PA) -> RT {
         std::vector<std::string> names;
         for (const auto& pair : g_app->envs) {
@@ -408,59 +643,59 @@ auto webview_init() -> void {
         }
         return names;
         });
-    server.register_async_method("wv/create", [](CTX ctx, PA params) {
-        handle_webview_create(ctx, params);
-        });
-    server.register_method("wv/close", [](PA params) -> RT {
-        int64_t id = params[0].get<int64_t>();
-        return g_app->webviews.erase(id) > 0;
+    server.register_async_method("wv/create", [session](CTX ctx, PA params) {
+        return handle_webview_create(ctx, params, session);
+        }, { .lane = jsonrpc::Lane::Bulk });
+    server.register_method<int64_t>("wv/close", [session](int64_t id) -> RT {
+        return find_webview(session, id) && g_app->webviews.erase(id) > 0;
         });
-    server.register_notification("wv/resize", with_webview_n([](WI it, PA params) {
-        RECT newBounds = {
-            params[1][0].get<LONG>(), params[1][1].get<LONG>(),
-            params[1][2].get<LONG>(), params[1][3].get<LONG>()
-        };
-        it->controller->put_Bounds(newBounds);
-        }));
-    server.register_notification("wv/set-visible", with_webview_n([](WI it, PA params) {
-        bool visible = params[1].get<bool>();
+    server.register_notification<int64_t, RECT>("wv/resize", with_webview_n(session, [](WI it, RECT bounds) {
+        it->controller->put_Bounds(bounds);
+        }), { .merge = latest_per_webview() });
+    server.register_notification<int64_t, bool>("wv/set-visible", with_webview_n(session, [](WI it, bool visible) {
         it->controller->put_IsVisible(visible ? TRUE : FALSE);
-        }));
-    server.register_method("wv/visible-p", with_webview([](WI it, PA params) -> RT {
+        }), { .merge = latest_per_webview() });
+    server.register_method<int64_t>("wv/visible-p", with_webview(session, [](WI it) -> RT {
         BOOL visible = false;
         it->controller->get_IsVisible(&visible);
         return visible == 1;
         }));
-    server.register_notification("wv/reparent", with_webview_n([](WI it, PA params) {
-        HWND newParent = (HWND)params[1].get<int64_t>();
-        it->controller->put_ParentWindow(newParent);
-        }));
-    server.register_method("wv/get-title", with_webview([](WI it, PA params) -> RT {
+    server.register_notification<int64_t, HWND>("wv/reparent", with_webview_n(session, [](WI it, HWND parent) {
+        it->controller->put_ParentWindow(parent);
+        }), { .merge = latest_per_webview() });
+    server.register_method<int64_t>("wv/get-title", with_webview(session, [](WI it) -> RT {
         wil::unique_cotaskmem_string title;
         it->webview->get_DocumentTitle(&title);
         return u::wstring_to_utf8(title.get());
         }));
-    server.register_method("wv/set-intercept-keys", with_webview([](WI it, PA params) -> RT {
+    server.register_async_method("wv/get-html", [session](CTX ctx, PA params) {
+        return handle_get_html(ctx, params, session);
+        }, { .lane = jsonrpc::Lane::Bulk });
+    server.register_async_method("wv/capture", [session](CTX ctx, PA params) {
+        return handle_capture(ctx, params, session);
+        }, { .lane = jsonrpc::Lane::Bulk });
+    server.register_method<int64_t, std::vector<uint32_t>>("wv/set-intercept-keys", with_webview(session, [](WI it, std::vector<uint32_t> keys) -> RT {
         it->intercept_keys.clear();
-        for (auto& k : params[1]) {
-            it->intercept_keys.insert(k.get<uint32_t>());
-        }
+        it->intercept_keys.insert(keys.begin(), keys.end());
         return true;
         }));
-    server.register_notification("wv/focus", with_webview_n([](WI it, PA) {
+    server.register_notification<int64_t>("wv/focus", with_webview_n(session, [](WI it) {
         it->controller->MoveFocus(COREWEBVIEW2_MOVE_FOCUS_REASON_PROGRAMMATIC);
         }));
-    server.register_notification("wv/navigate", with_webview_n([](WI it, PA params) {
-        std::string url = params[1].get<std::string>();
+    server.register_notification<int64_t, std::string_view>("wv/navigate", with_webview_n(session, [](WI it, std::string_view url) {
         std::wstring wurl = u::utf8_to_wstring(url);
         it->webview->Navigate(wurl.c_str());
         }));
-    server.register_notification("wv/sync-ui-batch", handle_sync_ui_batch);
-    server.register_method("wv/ssync-ui-batch", [](PA params) -> RT {
-        handle_sync_ui_batch(params);
+    // Batches carry every webview's layout, so all queued ones fold into one.
+    server.register_notification("wv/sync-ui-batch", [session](PA params) {
+        handle_sync_ui_batch(params, session);
+        }, {
+        .merge = { [](PA) -> std::optional<int64_t> { return 0; }, fold_sync_ui_batch } });
+    server.register_method("wv/ssync-ui-batch", [session](PA params) -> RT {
+        handle_sync_ui_batch(params, session);
         return true;
         });
-    server.register_method("wv/paste", with_webview([](WI it, PA) {
+    server.register_method<int64_t>("wv/paste", with_webview(session, [](WI it) -> RT {
         // it->controller->MoveFocus(COREWEBVIEW2_MOVE_FOCUS_REASON_PROGRAMMATIC);
         // it->webview->ExecuteScript(L"document.execCommand('paste')", nullptr);
         jsonrpc::json args;
@@ -0,0 +1,159 @@
+#pragma once
+
+// Awaitables for the WebView2 calls that report through a completion
+// handler, so coroutine handlers (jsonrpc::Task) read top to bottom:
+//
+//     auto [hr, env] = co_await wv2::create_environment(dir, options.Get());
+//     auto [hr2, controller] = co_await wv2::create_controller(env.Get(), hwnd);
+//
+// The coroutine resumes inside the completion handler, on the UI thread.
+// WebView2 never runs a handler before the call taking it has returned,
+// and never runs it if the call fails; then the coroutine goes on at once
+// with the call's HRESULT. Calls given a Pending resume with E_ABORT when
+// it is aborted, since a closed webview may never run their handlers.
+
+#include <WebView2.h>
+#include <Windows.h>
+#include <wrl.h>
+
+#include <algorithm>
+#include <coroutine>
+#include <memory>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace wv2 {
+
+// No result beyond the HRESULT.
+using None = std::monostate;
+
+namespace details {
+
+// A suspended coroutine, resumed by whichever of its handler and an abort
+// comes first.
+struct Waiter {
+    std::coroutine_handle<> h;
+    HRESULT* hr = nullptr;
+    bool done = false;
+};
+
+} // namespace details
+
+// Calls awaited on behalf of one object, such as a webview. abort(), or
+// destroying it, resumes those still waiting with E_ABORT. UI thread only.
+class Pending {
+public:
+    Pending() = default;
+    Pending(const Pending&) = delete;
+    Pending& operator=(const Pending&) = delete;
+    ~Pending() { abort(); }
+
+    void abort() {
+        auto waiters = std::move(waiters_);
+        waiters_.clear();
+        for (auto& w : waiters) {
+            if (w->done) continue;
+            w->done = true;
+            *w->hr = E_ABORT;
+            w->h.resume();
+        }
+    }
+
+    void add(std::shared_ptr<details::Waiter> w) { waiters_.push_back(std::move(w)); }
+    void remove(const details::Waiter* w) {
+        std::erase_if(waiters_, [w](const auto& p) { return p.get() == w; });
+    }
+
+private:
+    std::vector<std::shared_ptr<details::Waiter>> waiters_;
+};
+
+template <typename IHandler, typename T, typename Start>
+class Completion {
+public:
+    Completion(Start start, Pending* pending) : start_(std::move(start)), pending_(pending) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        auto waiter = std::make_shared<details::Waiter>();
+        waiter->h = h;
+        waiter->hr = &hr_;
+        auto handler = Microsoft::WRL::Callback<IHandler>([this, waiter](HRESULT hr, auto... args) -> HRESULT {
+            // Aborted: the coroutine went on, and this awaiter may be gone.
+            if (waiter->done) return S_OK;
+            waiter->done = true;
+            if (pending_) pending_->remove(waiter.get());
+            hr_ = hr;
+            (keep(args), ...);
+            waiter->h.resume();
+            return S_OK;
+            });
+        HRESULT hr = start_(handler.Get());
+        if (FAILED(hr)) {
+            hr_ = hr;
+            return false;
+        }
+        if (pending_) pending_->add(std::move(waiter));
+        return true;
+    }
+
+    // The HRESULT alone for None, else {HRESULT, result}.
+    auto await_resume() {
+        if constexpr (std::is_same_v<T, None>) {
+            return hr_;
+        } else {
+            return std::pair<HRESULT, T>(hr_, std::move(value_));
+        }
+    }
+
+private:
+    Start start_;
+    Pending* pending_;
+    HRESULT hr_ = E_FAIL;
+    T value_{};
+
+    // Interface pointers are AddRef'd, strings copied; null stays empty.
+    template <typename P>
+    void keep(P p) {
+        if (p) value_ = p;
+    }
+};
+
+// Await the call made by `start` with a completion handler of type IHandler.
+template <typename IHandler, typename T = None, typename Start>
+Completion<IHandler, T, Start> completion(Start start, Pending* pending = nullptr) {
+    return Completion<IHandler, T, Start>(std::move(start), pending);
+}
+
+inline auto create_environment(PCWSTR user_data_dir, ICoreWebView2EnvironmentOptions* options) {
+    using Handler = ICoreWebView2CreateCoreWebView2EnvironmentCompletedHandler;
+    return completion<Handler, Microsoft::WRL::ComPtr<ICoreWebView2Environment>>(
+        [user_data_dir, options](Handler* h) {
+            return CreateCoreWebView2EnvironmentWithOptions(nullptr, user_data_dir, options, h);
+        });
+}
+
+inline auto create_controller(ICoreWebView2Environment* env, HWND hwnd) {
+    using Handler = ICoreWebView2CreateCoreWebView2ControllerCompletedHandler;
+    return completion<Handler, Microsoft::WRL::ComPtr<ICoreWebView2Controller>>(
+        [env, hwnd](Handler* h) { return env->CreateCoreWebView2Controller(hwnd, h); });
+}
+
+// The result is the script's value, JSON-encoded.
+inline auto execute_script(ICoreWebView2* webview, PCWSTR script, Pending* pending = nullptr) {
+    using Handler = ICoreWebView2ExecuteScriptCompletedHandler;
+    return completion<Handler, std::wstring>(
+        [webview, script](Handler* h) { return webview->ExecuteScript(script, h); }, pending);
+}
+
+inline auto capture_preview(ICoreWebView2* webview, COREWEBVIEW2_CAPTURE_PREVIEW_IMAGE_FORMAT format, IStream* stream,
+                            Pending* pending = nullptr) {
+    using Handler = ICoreWebView2CapturePreviewCompletedHandler;
+    return completion<Handler>(
+        [webview, format, stream](Handler* h) { return webview->CapturePreview(format, stream, h); }, pending);
+}
+
+} // namespace wv2
@@ -8,24 +8,31 @@
 #include <memory>
 #include <unordered_set>
 #include "jsonrpc.hpp"
+#include "listener.hpp"
+#include "wv2_async.h"
 
 using namespace Microsoft::WRL;
 
+// Session of the Emacs that spawned us, over stdin/stdout. Clients of the
+// --listen endpoint get ids from 1 up.
+constexpr int64_t kStdioSession = 0;
+
 struct WebViewInitParams {
     int64_t id;
     HWND hwnd;
     bool visible;
     RECT bounds;
     std::wstring url;
-    ComPtr<ICoreWebView2Environment> env;
-
-    std::function<void(int64_t)> on_created;
-    std::function<void(HRESULT)> on_error;
+    // Session that asked for the webview and will own it.
+    int64_t session = kStdioSession;
 };
 
 struct WebViewInstance : public std::enable_shared_from_this<WebViewInstance> {
     // Unique ID for this instance, used for mapping and communication with Emacs
     int64_t id{ 0 };
+    // Session that created it. Only that session can drive it, and its
+    // events go only there.
+    int64_t session{ kStdioSession };
     // WebView COM interfaces
     ComPtr<ICoreWebView2Controller> controller;
     ComPtr<ICoreWebView2> webview;
@@ -33,6 +40,8 @@ struct WebViewInstance : public std::enable_shared_from_this<WebViewInstance> {
     std::unordered_set<uint32_t> intercept_keys;
     // Callbacks cleanup
     std::vector <std::function<void()>> cleanup_tasks;
+    // Calls awaited on this webview, aborted when it closes.
+    wv2::Pending pending;
 
     template <typename IHandler, typename... Args>
     auto create_safe_callback(HRESULT(WebViewInstance::* func)(Args...)) {
@@ -57,30 +66,44 @@ struct WebViewInstance : public std::enable_shared_from_this<WebViewInstance> {
 
     void setup_all_events();
     void close();
+    // Send a notification to the owning session, if it is still connected.
+    void notify(const std::string& method, const jsonrpc::json& params);
 
     HRESULT on_title_changed(ICoreWebView2* sender, IUnknown* args);
     HRESULT on_key_pressed(ICoreWebView2Controller* sender, ICoreWebView2AcceleratorKeyPressedEventArgs* args);
     HRESULT on_new_window(ICoreWebView2* sender, ICoreWebView2NewWindowRequestedEventArgs* args);
 
-    static void Create(WebViewInitParams params);
+    // Wrap a freshly created controller and register the instance.
+    static std::shared_ptr<WebViewInstance> Create(const WebViewInitParams& params, ComPtr<ICoreWebView2Controller> controller);
     ~WebViewInstance() { close(); };
 };
 
+// Register the manager's methods on the connection of a session.
+void webview_init(jsonrpc::Conn& server, int64_t session);
+// Close the webviews a session owns, once it is gone.
+void webview_release_session(int64_t session);
+
 struct AppContext {
     // dummy hwnd for borned webview2
     HWND dummy_hwnd = nullptr;
     // JSONRPC server
     jsonrpc::Conn server;
+    // Further clients, with --listen.
+    jsonrpc::Listener listener;
     // WebView2 environments
     std::map<std::string, Microsoft::WRL::ComPtr<ICoreWebView2Environment>> envs;
     // All WebView2 instances
     std::map<int64_t, std::shared_ptr<WebViewInstance>> webviews;
 
-    AppContext(jsonrpc::Conn::Waker waker) : server(std::move(waker)) {}
+    AppContext(jsonrpc::Conn::Waker waker)
+        : server(waker), listener(waker, webview_init, webview_release_session) {}
+
+    // Connection of a session, nullptr once it is gone.
+    jsonrpc::Conn* conn_of(int64_t session) {
+        return session == kStdioSession ? &server : listener.session(session);
+    }
 
     ~AppContext() { webviews.clear(); }
 };
 
 extern std::unique_ptr<AppContext> g_app;
-
-void webview_init();